@@ -0,0 +1,271 @@
+#ifndef MINION_BENCH_H
+#define MINION_BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Benchmark harness shared by the drivers for the four implementations.
+ * Each driver reads all the corpus files ("<kind>-<size>.minion") in a
+ * directory and measures its scenarios (parse, dump, ...) on each of
+ * them. A measurement is repeated until it has run for at least
+ * `min_time` seconds, including any setup for each iteration (and at
+ * least `min_iterations` times). The results
+ * are written as JSON: throughput in MB/s (or nanoseconds per operation)
+ * and percentiles of the time per iteration.
+ * Some of the implementations have operations which are quadratic in
+ * the size of the input. When a single iteration takes more than
+ * `time_limit` seconds, or is expected to (extrapolating linearly from
+ * the previous file of the same kind), the remaining measurements on
+ * files of that kind are skipped.
+ */
+
+namespace bench {
+
+struct corpus_file
+{
+    std::string path;
+    std::string kind; // the part of the name before the last '-'
+    std::string label; // the part after it, e.g. "64K"
+    size_t size;
+    std::string data; // NUL-terminated by std::string
+};
+
+struct result
+{
+    std::string kind;
+    std::string label;
+    size_t bytes;
+    std::string scenario;
+    std::vector<double> times; // seconds per iteration
+    size_t ops; // operations per iteration, 0 if measured in bytes
+    std::string skipped; // reason, if not measured
+};
+
+class Bench
+{
+    std::string implementation;
+    std::vector<corpus_file> files;
+    std::vector<result> results;
+    // the kinds of corpus file which have exceeded the time limit
+    std::vector<std::string> over_limit;
+    // scenario/kind -> bytes and time per iteration of the last file
+    std::map<std::string, std::pair<size_t, double>> previous;
+
+public:
+    double min_time = 0.5;
+    size_t min_iterations = 3;
+    size_t max_iterations = 10000;
+    double time_limit = 5.0;
+    std::string output; // file for the JSON results, default stdout
+
+    Bench(
+        const char* impl)
+        : implementation{impl}
+    {}
+
+    // Handle the command line: [-o file] [-t min_time] [-l time_limit]
+    // corpus directory (or files). Return false if it is not valid.
+    bool init(
+        int argc, char** argv)
+    {
+        std::vector<std::string> paths;
+        for (int i = 1; i < argc; ++i) {
+            std::string a{argv[i]};
+            if ((a == "-o" || a == "-t" || a == "-l") && i + 1 < argc) {
+                const char* v = argv[++i];
+                if (a == "-o")
+                    output = v;
+                else if (a == "-t")
+                    min_time = std::atof(v);
+                else
+                    time_limit = std::atof(v);
+            } else if (a[0] == '-') {
+                return false;
+            } else if (std::filesystem::is_directory(a)) {
+                for (auto& e : std::filesystem::directory_iterator(a)) {
+                    if (e.path().extension() == ".minion")
+                        paths.push_back(e.path().string());
+                }
+            } else {
+                paths.push_back(a);
+            }
+        }
+        if (paths.empty())
+            return false;
+        for (auto& p : paths) {
+            corpus_file f;
+            f.path = p;
+            std::string name = std::filesystem::path(p).stem().string();
+            auto i = name.rfind('-');
+            f.kind = name.substr(0, i);
+            f.label = (i == std::string::npos) ? name : name.substr(i + 1);
+            f.size = std::filesystem::file_size(p);
+            files.push_back(std::move(f));
+        }
+        // By kind, then in order of increasing size (for the time limit)
+        std::sort(files.begin(), files.end(), [](auto& a, auto& b) {
+            return a.kind != b.kind ? a.kind < b.kind : a.size < b.size;
+        });
+        return true;
+    }
+
+    void usage(
+        const char* prog)
+    {
+        fprintf(stderr,
+                "Usage: %s [-o output.json] [-t min_time] [-l time_limit]"
+                " corpus_dir_or_files ...\n",
+                prog);
+    }
+
+    // Call `f` for each corpus file, the data being loaded only while it
+    // is in use.
+    void for_each_file(
+        const std::function<void(corpus_file&)>& f)
+    {
+        for (auto& cf : files) {
+            if (!load(cf))
+                continue;
+            fprintf(stderr, "%s: %s\n", implementation.c_str(), cf.path.c_str());
+            f(cf);
+            std::string{}.swap(cf.data);
+        }
+    }
+
+    /* Measure `timed`, calling `setup` (untimed) before each iteration.
+     * `ops` is the number of operations in one iteration, if the result
+     * is to be given per operation rather than per byte of input.
+     * `timed` returns false if the operation fails, which ends the
+     * measurement.
+     */
+    void run(
+        corpus_file& cf,
+        const char* scenario,
+        const std::function<bool()>& timed,
+        const std::function<void()>& setup = nullptr,
+        size_t ops = 0)
+    {
+        result r{cf.kind, cf.label, cf.size, scenario, {}, ops, {}};
+        if (std::find(over_limit.begin(), over_limit.end(), cf.kind) != over_limit.end()) {
+            r.skipped = "time limit exceeded";
+            results.push_back(std::move(r));
+            return;
+        }
+        std::string key = r.scenario + '/' + cf.kind;
+        auto p = previous.find(key);
+        if (p != previous.end() && p->second.second * cf.size / p->second.first > time_limit) {
+            over_limit.push_back(cf.kind);
+            r.skipped = "time limit exceeded";
+            results.push_back(std::move(r));
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        while (r.times.size() < max_iterations
+               && (r.times.size() < min_iterations
+                   || std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                          < min_time)) {
+            if (setup)
+                setup();
+            auto t0 = std::chrono::steady_clock::now();
+            bool ok = timed();
+            auto t1 = std::chrono::steady_clock::now();
+            if (!ok) {
+                r.skipped = "failed";
+                break;
+            }
+            double t = std::chrono::duration<double>(t1 - t0).count();
+            r.times.push_back(t);
+            if (t > time_limit) {
+                over_limit.push_back(cf.kind);
+                break;
+            }
+        }
+        if (!r.times.empty())
+            previous[key] = {cf.size, *std::min_element(r.times.begin(), r.times.end())};
+        results.push_back(std::move(r));
+    }
+
+    // Write the results, return false if the output file can't be opened
+    bool report()
+    {
+        FILE* fp = stdout;
+        if (!output.empty() && !(fp = fopen(output.c_str(), "w"))) {
+            perror(output.c_str());
+            return false;
+        }
+        fprintf(fp, "{\n  \"implementation\": \"%s\",\n  \"results\": [", implementation.c_str());
+        const char* sep = "\n";
+        for (auto& r : results) {
+            fprintf(fp,
+                    "%s    {\"corpus\": \"%s\", \"size\": \"%s\", \"bytes\": %zu,"
+                    " \"scenario\": \"%s\"",
+                    sep,
+                    r.kind.c_str(),
+                    r.label.c_str(),
+                    r.bytes,
+                    r.scenario.c_str());
+            sep = ",\n";
+            if (!r.skipped.empty()) {
+                fprintf(fp, ", \"skipped\": \"%s\"}", r.skipped.c_str());
+                continue;
+            }
+            auto t = r.times;
+            std::sort(t.begin(), t.end());
+            double p50 = percentile(t, 50);
+            fprintf(fp, ", \"iterations\": %zu", t.size());
+            if (r.ops)
+                fprintf(fp, ", \"ops\": %zu, \"ns_per_op\": %.2f", r.ops, p50 * 1e9 / r.ops);
+            else
+                fprintf(fp, ", \"mb_per_s\": %.2f", r.bytes / p50 / 1e6);
+            fprintf(fp,
+                    ", \"min_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f,"
+                    " \"p99_ms\": %.4f, \"max_ms\": %.4f}",
+                    t.front() * 1e3,
+                    p50 * 1e3,
+                    percentile(t, 90) * 1e3,
+                    percentile(t, 99) * 1e3,
+                    t.back() * 1e3);
+        }
+        fprintf(fp, "\n  ]\n}\n");
+        if (fp != stdout)
+            fclose(fp);
+        return true;
+    }
+
+private:
+    static bool load(
+        corpus_file& cf)
+    {
+        FILE* fp = fopen(cf.path.c_str(), "rb");
+        if (!fp) {
+            perror(cf.path.c_str());
+            return false;
+        }
+        cf.data.resize(cf.size);
+        size_t n = fread(cf.data.data(), 1, cf.size, fp);
+        fclose(fp);
+        cf.data.resize(n);
+        return true;
+    }
+
+    // Nearest-rank percentile of sorted values
+    static double percentile(
+        const std::vector<double>& sorted, int p)
+    {
+        size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+        return sorted[rank ? rank - 1 : 0];
+    }
+};
+
+} // namespace bench
+
+#endif // MINION_BENCH_H
@@ -0,0 +1,52 @@
+/* Benchmark driver for the C interface, shared by minion_c and
+ * minion_cxx_c. This interface has no copy or lookup functions, so only
+ * parsing, dumping and freeing are measured.
+ */
+
+#include "bench.h"
+#include "minion.h"
+
+#ifndef BENCH_IMPLEMENTATION
+#define BENCH_IMPLEMENTATION "minion_c"
+#endif
+
+int main(
+    int argc, char** argv)
+{
+    bench::Bench b(BENCH_IMPLEMENTATION);
+    if (!b.init(argc, argv)) {
+        b.usage(argv[0]);
+        return 1;
+    }
+
+    b.for_each_file([&](bench::corpus_file& cf) {
+        const char* input = cf.data.c_str();
+        minion_doc doc{};
+
+        b.run(
+            cf,
+            "parse",
+            [&]() {
+                doc = minion_read(input);
+                return !minion_error(doc);
+            },
+            [&]() { minion_free(doc); });
+
+        if (doc.minion_item.type && !minion_error(doc)) {
+            b.run(cf, "dump", [&]() { return minion_dump(doc.minion_item, -1) != nullptr; });
+            minion_tidy_dump();
+        }
+        minion_free(doc);
+
+        b.run(
+            cf,
+            "free",
+            [&]() {
+                minion_free(doc);
+                return true;
+            },
+            [&]() { doc = minion_read(input); });
+    });
+    minion_tidy();
+    return b.report() ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+/* Benchmark driver for minion_cxx. */
+
+#include "bench.h"
+#include "minion.h"
+
+using namespace minion;
+
+// Collect the maps in a document, with their keys
+static void collect_keys(
+    MValue& m, std::vector<std::pair<MMap*, std::string>>& keys)
+{
+    if (auto ml = m.m_list()) {
+        for (size_t i = 0; i < ml->size(); ++i)
+            collect_keys(ml->get(i), keys);
+    } else if (auto mm = m.m_map()) {
+        for (size_t i = 0; i < mm->size(); ++i) {
+            MPair& mp = mm->get_pair(i);
+            keys.emplace_back(mm, std::string{mp.first});
+            collect_keys(mp.second, keys);
+        }
+    }
+}
+
+int main(
+    int argc, char** argv)
+{
+    bench::Bench b("minion_cxx");
+    if (!b.init(argc, argv)) {
+        b.usage(argv[0]);
+        return 1;
+    }
+
+    InputBuffer ib;
+    DumpBuffer db;
+    b.for_each_file([&](bench::corpus_file& cf) {
+        std::string_view input = cf.data;
+        MinionValue m;
+
+        b.run(
+            cf,
+            "parse",
+            [&]() { return !ib.read(m, input); },
+            [&]() { m = {}; });
+
+        Document doc;
+        b.run(cf, "parse_arena", [&]() { return !ib.read(doc, input); });
+        doc.clear();
+
+        if (m.is_null())
+            return;
+
+        b.run(cf, "dump", [&]() { return db.dump(m, -1) != nullptr; });
+
+        MinionValue copy;
+        b.run(
+            cf,
+            "copy",
+            [&]() {
+                m.copy(copy);
+                return true;
+            },
+            [&]() { copy = {}; });
+        copy = {};
+
+        std::vector<std::pair<MMap*, std::string>> keys;
+        collect_keys(m, keys);
+        if (!keys.empty()) {
+            b.run(
+                cf,
+                "lookup",
+                [&]() {
+                    size_t found = 0;
+                    for (auto& k : keys)
+                        found += (k.first->search(k.second) >= 0);
+                    return found == keys.size();
+                },
+                nullptr,
+                keys.size());
+        }
+
+        b.run(
+            cf,
+            "free",
+            [&]() {
+                m = {};
+                return true;
+            },
+            [&]() { ib.read(m, input); });
+    });
+    return b.report() ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+/* Benchmark driver for minion_cxx_shared. The values are shared rather
+ * than copied, so there is no copy scenario here; instead there are the
+ * Tape representation and the binary form.
+ */
+
+#include "bench.h"
+#include "binary.h"
+#include "minion.h"
+#include "tape.h"
+
+using namespace minion;
+
+// Collect the maps in a document, with their keys
+static void collect_keys(
+    MValue& m, std::vector<std::pair<MMap*, std::string>>& keys)
+{
+    if (auto ml = m.m_list()) {
+        for (auto& v : **ml)
+            collect_keys(v, keys);
+    } else if (auto mm = m.m_map()) {
+        for (size_t i = 0; i < (*mm)->size(); ++i) {
+            MPair& mp = (*mm)->get_pair(i);
+            keys.emplace_back(mm->get(), mp.first);
+            collect_keys(mp.second, keys);
+        }
+    }
+}
+
+int main(
+    int argc, char** argv)
+{
+    bench::Bench b("minion_cxx_shared");
+    if (!b.init(argc, argv)) {
+        b.usage(argv[0]);
+        return 1;
+    }
+
+    b.for_each_file([&](bench::corpus_file& cf) {
+        std::string_view input = cf.data;
+        MValue m;
+
+        b.run(
+            cf,
+            "parse",
+            [&]() {
+                m = Reader::read(input);
+                return m.type() != T_Error;
+            },
+            [&]() { m = {}; });
+
+        // Only the top level is read; the rest is scanned
+        MValue lazy;
+        b.run(
+            cf,
+            "parse_lazy",
+            [&]() {
+                lazy = Reader::read_lazy(input);
+                return lazy.type() != T_Error;
+            },
+            [&]() { lazy = {}; });
+        lazy = {};
+
+        Tape tape;
+        b.run(cf, "parse_tape", [&]() { return !tape.read(input); });
+        tape.clear();
+
+        if (m.is_null() || m.type() == T_Error)
+            return;
+
+        b.run(cf, "dump", [&]() {
+            Writer w(m, -1);
+            return w.dump_c() != nullptr;
+        });
+
+        // The binary form of the document is loaded instead of the text
+        std::string binary = BinaryWriter::dump(m);
+        MValue mb;
+        b.run(
+            cf,
+            "load_binary",
+            [&]() {
+                mb = Reader::read_binary(binary);
+                return mb.type() != T_Error;
+            },
+            [&]() { mb = {}; });
+        mb = {};
+
+        std::vector<std::pair<MMap*, std::string>> keys;
+        collect_keys(m, keys);
+        if (!keys.empty()) {
+            b.run(
+                cf,
+                "lookup",
+                [&]() {
+                    size_t found = 0;
+                    for (auto& k : keys)
+                        found += (k.first->find(k.second) != nullptr);
+                    return found == keys.size();
+                },
+                nullptr,
+                keys.size());
+        }
+
+        b.run(
+            cf,
+            "free",
+            [&]() {
+                m = {};
+                return true;
+            },
+            [&]() { m = Reader::read(input); });
+    });
+    return b.report() ? 0 : 1;
+}
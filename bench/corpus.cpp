@@ -0,0 +1,253 @@
+/* Generate the synthetic benchmark corpus: one file of each kind for
+ * each of the given sizes, "<dir>/<kind>-<size>.minion". The content is
+ * determined by the kind and size alone, so an existing file is not
+ * generated again.
+ *
+ *   deep    – a list of items nested 32 levels deep (alternately maps
+ *             and lists)
+ *   wide    – a single map with many keys
+ *   longstr – a list of long delimited strings (1 KB – 64 KB, but no
+ *             longer than the file)
+ *   escapes – a list of delimited strings with many escapes
+ *   macros  – many macro definitions, then a list of references to them
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+namespace {
+
+// Deterministic pseudo-random numbers (splitmix64)
+struct Random
+{
+    uint64_t state;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+    // In the range [lo, hi]
+    size_t range(
+        size_t lo, size_t hi)
+    {
+        return lo + next() % (hi - lo + 1);
+    }
+};
+
+class Output
+{
+    FILE* fp;
+    size_t n{0};
+
+public:
+    Output(
+        FILE* f)
+        : fp{f}
+    {}
+
+    size_t size() { return n; }
+
+    void put(
+        std::string_view s)
+    {
+        fwrite(s.data(), 1, s.size(), fp);
+        n += s.size();
+    }
+};
+
+const char* const words[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta",
+                             "theta", "iota", "kappa", "lambda", "mu", "1+", "nt", "09"};
+const size_t n_words = sizeof(words) / sizeof(words[0]);
+
+const char* word(
+    Random& r)
+{
+    return words[r.next() % n_words];
+}
+
+void deep_item(
+    Output& out, Random& r, int depth)
+{
+    if (depth == 0) {
+        out.put(word(r));
+        return;
+    }
+    if (depth % 2) {
+        out.put("{");
+        out.put(word(r));
+        out.put(": ");
+        deep_item(out, r, depth - 1);
+        out.put(", n: ");
+        out.put(word(r));
+        out.put("}");
+    } else {
+        out.put("[");
+        out.put(word(r));
+        out.put(", ");
+        deep_item(out, r, depth - 1);
+        out.put("]");
+    }
+}
+
+void gen_deep(
+    Output& out, Random& r, size_t size)
+{
+    out.put("[\n");
+    while (out.size() < size) {
+        deep_item(out, r, 32);
+        out.put(",\n");
+    }
+    out.put("]\n");
+}
+
+void gen_wide(
+    Output& out, Random& r, size_t size)
+{
+    char key[16];
+    out.put("{\n");
+    // Unique keys, not in sorted order
+    for (uint32_t i = 0; out.size() < size; ++i) {
+        snprintf(key, sizeof(key), "k%08x: ", i * 2654435761u);
+        out.put(key);
+        out.put(word(r));
+        out.put(",\n");
+    }
+    out.put("}\n");
+}
+
+void gen_longstr(
+    Output& out, Random& r, size_t size)
+{
+    out.put("[\n");
+    while (out.size() < size) {
+        size_t len = std::min(r.range(1024, 65536), size);
+        size_t start = out.size();
+        out.put("\"");
+        while (out.size() - start < len) {
+            out.put(word(r));
+            out.put(" ");
+        }
+        out.put("\",\n");
+    }
+    out.put("]\n");
+}
+
+void gen_escapes(
+    Output& out, Random& r, size_t size)
+{
+    const char* const escapes[] = {"\\n", "\\t", "\\\"", "\\\\", "\\u00e9", "\\U01F600", "\\/"};
+    out.put("[\n");
+    while (out.size() < size) {
+        out.put("\"");
+        for (int i = 0; i < 16; ++i) {
+            out.put(word(r));
+            out.put(escapes[r.next() % 7]);
+        }
+        out.put("\",\n");
+    }
+    out.put("]\n");
+}
+
+void gen_macros(
+    Output& out, Random& r, size_t size)
+{
+    // About one macro for each KB, up to 10000
+    size_t n = std::min<size_t>(std::max<size_t>(size / 1024, 1), 10000);
+    char name[16];
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(name, sizeof(name), "&M%05zu", i);
+        out.put(name);
+        out.put(": [");
+        out.put(word(r));
+        out.put(", ");
+        out.put(word(r));
+        out.put(", {x: ");
+        out.put(word(r));
+        out.put("}],\n");
+    }
+    out.put("[\n");
+    while (out.size() < size) {
+        snprintf(name, sizeof(name), "&M%05zu", size_t(r.next() % n));
+        out.put(name);
+        out.put(",\n");
+    }
+    out.put("]\n");
+}
+
+struct kind
+{
+    const char* name;
+    void (*generate)(Output&, Random&, size_t);
+};
+
+const kind kinds[] = {
+    {"deep", gen_deep},
+    {"wide", gen_wide},
+    {"longstr", gen_longstr},
+    {"escapes", gen_escapes},
+    {"macros", gen_macros},
+};
+
+// Parse a size such as "64K", "16M" or "1G"
+size_t parse_size(
+    const char* s)
+{
+    char* end;
+    size_t n = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'K':
+        return n << 10;
+    case 'M':
+        return n << 20;
+    case 'G':
+        return n << 30;
+    }
+    return n;
+}
+
+} // namespace
+
+int main(
+    int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s directory size ...\n", argv[0]);
+        return 1;
+    }
+    std::filesystem::path dir{argv[1]};
+    std::filesystem::create_directories(dir);
+    for (int i = 2; i < argc; ++i) {
+        size_t size = parse_size(argv[i]);
+        for (auto& k : kinds) {
+            auto path = dir / (std::string{k.name} + '-' + argv[i] + ".minion");
+            if (std::filesystem::exists(path))
+                continue;
+            // Write to a temporary file, so that an interrupted run
+            // leaves no incomplete file
+            auto tmp = path;
+            tmp += ".tmp";
+            FILE* fp = fopen(tmp.c_str(), "wb");
+            if (!fp) {
+                perror(tmp.c_str());
+                return 1;
+            }
+            Output out(fp);
+            Random r{size};
+            k.generate(out, r, size);
+            if (fclose(fp) != 0) {
+                perror(tmp.c_str());
+                return 1;
+            }
+            std::filesystem::rename(tmp, path);
+            printf("%s: %zu bytes\n", path.c_str(), out.size());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+# Join the JSON results of the benchmark drivers (INPUTS, a list of
+# files) in a single array (OUTPUT).
+
+set(sep "")
+set(json "[\n")
+foreach(f ${INPUTS})
+  file(READ ${f} part)
+  string(STRIP "${part}" part)
+  string(APPEND json "${sep}${part}")
+  set(sep ",\n")
+endforeach()
+string(APPEND json "\n]\n")
+file(WRITE ${OUTPUT} "${json}")
@@ -22,7 +22,7 @@ int main()
         parsed = minion_read(f);
 
         clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end); // Get current time
-        double elapsed = end.tv_sec - start.tv_sec;
+        double elapsed = (end.tv_sec - start.tv_sec) * 1e6;
         elapsed += (end.tv_nsec - start.tv_nsec) / 1000.0;
         printf("%0.2f microseconds elapsed\n", elapsed);
         minion_free(parsed);
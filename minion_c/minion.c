@@ -226,7 +226,81 @@ void free_item(
 // Manage the macros
 static macro_node* macros = NULL;
 
-void new_macro() {}
+/* The macros are found by name using a hash table (open addressing) of
+ * pointers to the nodes of the `macros` list, which remains the owner of
+ * the macros and is passed on to the document. The table is kept at
+ * most half full, and its memory is retained between minion_read calls
+ * (see minion_tidy).
+ */
+typedef struct
+{
+    unsigned int hash;
+    macro_node* node; // NULL if the slot is empty
+} macro_slot;
+
+static macro_slot* macro_table = 0;
+static size_t macro_table_size = 0; // a power of 2
+static size_t macro_table_count = 0;
+
+unsigned int hash_name(
+    const char* name)
+{
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (; *name; ++name) {
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+macro_slot* find_macro_slot(
+    const char* name, unsigned int h)
+{
+    size_t mask = macro_table_size - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        macro_slot* s = &macro_table[i];
+        if (!s->node || (s->hash == h && strcmp(name, s->node->name) == 0))
+            return s;
+    }
+}
+
+// Enter a new macro (already added to the `macros` list) in the table.
+// If the name has been defined before, the new definition replaces it.
+void new_macro(
+    macro_node* mp)
+{
+    if ((macro_table_count + 1) * 2 > macro_table_size) {
+        // Move the entries to a larger table
+        size_t n = macro_table_size ? macro_table_size * 2 : 64;
+        macro_slot* tmp = calloc(n, sizeof(macro_slot));
+        if (tmp == NULL)
+            exit(1);
+        macro_slot* old = macro_table;
+        size_t old_size = macro_table_size;
+        macro_table = tmp;
+        macro_table_size = n;
+        for (size_t i = 0; i < old_size; ++i) {
+            if (old[i].node)
+                *find_macro_slot(old[i].node->name, old[i].hash) = old[i];
+        }
+        free(old);
+    }
+    unsigned int h = hash_name(mp->name);
+    macro_slot* s = find_macro_slot(mp->name, h);
+    if (!s->node)
+        ++macro_table_count;
+    *s = (macro_slot) {h, mp};
+}
+
+// Empty the table (the macros themselves are not freed)
+void clear_macro_table()
+{
+    if (macro_table_count) {
+        memset(macro_table, 0, macro_table_size * sizeof(macro_slot));
+        macro_table_count = 0;
+    }
+}
 
 void free_macros(
     macro_node* mp)
@@ -243,14 +317,10 @@ void free_macros(
 minion_value* find_macro(
     char* name)
 {
-    macro_node* mp = macros;
-    while (mp) {
-        if (strcmp(name, mp->name) == 0) {
-            return &mp->value;
-        }
-        mp = mp->next;
-    }
-    return NULL;
+    if (!macro_table_count)
+        return NULL;
+    macro_slot* s = find_macro_slot(name, hash_name(name));
+    return s->node ? &s->node->value : NULL;
 }
 
 bool real_minion_value(
@@ -289,6 +359,11 @@ void minion_tidy()
     remembered_items = 0;
     remembered_items_size = 0;
     remembered_items_index = 0;
+
+    free(macro_table);
+    macro_table = 0;
+    macro_table_size = 0;
+    macro_table_count = 0;
 }
 
 bool minion_isString(
@@ -873,6 +948,7 @@ minion_doc minion_read(
         }
         remembered_items_index = 0;
         // Free any macros
+        clear_macro_table();
         free_macros(macros);
         macros = NULL;
         // Prepare error message
@@ -928,6 +1004,7 @@ minion_doc minion_read(
                     exit(1);
                 *a = (macro_node) {mname.data, macros, mval};
                 macros = a;
+                new_macro(a);
                 continue;
             }
             error("After macro definition: expecting ',' at position %s", pos(current_position));
@@ -941,6 +1018,7 @@ minion_doc minion_read(
     remembered_items_index = 0;
     minion_doc doc = {m, {T_NoType, F_NoFlags, 0, NULL}, macros};
     macros = NULL;
+    clear_macro_table();
 
     // Check that there are no further items
     position current_position = here();
@@ -0,0 +1,292 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+/* Conversion of strings to numbers, booleans and durations. The string
+ * is read in place, without copying, and errors are reported by the
+ * result rather than by exceptions.
+ *  - Integers are read as by `std::stoi` with base 0: optional leading
+ *    white space and sign, then decimal digits, octal digits after a
+ *    leading "0", or hexadecimal digits after "0x".
+ *  - Floating-point numbers are read by `std::from_chars` (after optional
+ *    leading white space and sign).
+ *  - Booleans are "true" or "false".
+ *  - Durations are a number (integer or not) followed by a unit: "ns",
+ *    "us", "ms", "s", "min", "h" or "d", e.g. "250ms" or "1.5h".
+ * If MINION_CONVERSION_CACHE is defined, a string value (MString) keeps
+ * the result of its last conversion to an integer, floating-point number
+ * or boolean, so that reading it again costs nothing. The cache is not
+ * cleared if the string is changed in place. As a typed `get` then writes
+ * to the value it reads, the values of a `MacroLibrary`, which are shared
+ * by the documents using it, must not be read with it by more than one
+ * thread at a time in such a build.
+ */
+
+namespace minion {
+
+enum class conversion { ok, invalid, out_of_range };
+
+template<typename T>
+struct is_duration : std::false_type
+{};
+template<typename Rep, typename Period>
+struct is_duration<std::chrono::duration<Rep, Period>> : std::true_type
+{};
+
+// The name of the type of value, for error messages
+template<typename T>
+constexpr const char* conversion_name()
+{
+    if constexpr (std::is_same_v<T, bool>)
+        return "boolean";
+    else if constexpr (std::is_integral_v<T>)
+        return "integer";
+    else if constexpr (std::is_floating_point_v<T>)
+        return "number";
+    else
+        return "duration";
+}
+
+namespace detail {
+
+inline const char* skip_space(
+    const char* p, const char* end)
+{
+    while (p != end && (*p == ' ' || (*p >= '\t' && *p <= '\r')))
+        ++p;
+    return p;
+}
+
+// Read an integer as its magnitude and sign
+inline conversion read_integer(
+    std::string_view s, uint64_t& magnitude, bool& negative)
+{
+    const char* p = skip_space(s.data(), s.data() + s.size());
+    const char* end = s.data() + s.size();
+    negative = false;
+    if (p != end && (*p == '+' || *p == '-'))
+        negative = (*p++ == '-');
+    int base = 10;
+    if (end - p > 1 && p[0] == '0') {
+        if (p[1] == 'x' || p[1] == 'X') {
+            base = 16;
+            p += 2;
+        } else {
+            base = 8;
+            ++p;
+        }
+    }
+    auto [q, ec] = std::from_chars(p, end, magnitude, base);
+    if (ec == std::errc::result_out_of_range)
+        return conversion::out_of_range;
+    if (ec != std::errc() || q != end)
+        return conversion::invalid;
+    return conversion::ok;
+}
+
+template<typename T>
+conversion convert_integer(
+    std::string_view s, T& value)
+{
+    uint64_t m;
+    bool negative;
+    conversion c = read_integer(s, m, negative);
+    if (c != conversion::ok)
+        return c;
+    if constexpr (std::is_signed_v<T>) {
+        using U = std::make_unsigned_t<T>;
+        if (negative) {
+            if (m > U(std::numeric_limits<T>::max()) + 1)
+                return conversion::out_of_range;
+            value = T(0 - U(m));
+        } else {
+            if (m > U(std::numeric_limits<T>::max()))
+                return conversion::out_of_range;
+            value = T(m);
+        }
+    } else {
+        if ((negative && m != 0) || m > std::numeric_limits<T>::max())
+            return conversion::out_of_range;
+        value = T(m);
+    }
+    return conversion::ok;
+}
+
+template<typename T>
+conversion convert_floating(
+    std::string_view s, T& value)
+{
+    const char* end = s.data() + s.size();
+    const char* p = skip_space(s.data(), end);
+    if (p != end && *p == '+' && end - p > 1 && p[1] != '-')
+        ++p;
+    auto [q, ec] = std::from_chars(p, end, value);
+    if (ec == std::errc::result_out_of_range)
+        return conversion::out_of_range;
+    if (ec != std::errc() || q != end)
+        return conversion::invalid;
+    return conversion::ok;
+}
+
+inline conversion convert_bool(
+    std::string_view s, bool& value)
+{
+    if (s == "true")
+        value = true;
+    else if (s == "false")
+        value = false;
+    else
+        return conversion::invalid;
+    return conversion::ok;
+}
+
+template<typename Rep, typename Period, typename Unit>
+conversion make_duration(
+    std::string_view number, std::chrono::duration<Rep, Period>& value)
+{
+    using D = std::chrono::duration<Rep, Period>;
+    int64_t n;
+    if (convert_integer(number, n) == conversion::ok) {
+        // Exact, if it is in range
+        double v = double(n) * Unit::num * Period::den / (double(Unit::den) * Period::num);
+        if (std::is_integral_v<Rep>
+            && std::fabs(v) >= double(std::numeric_limits<Rep>::max()))
+            return conversion::out_of_range;
+        value = std::chrono::duration_cast<D>(std::chrono::duration<int64_t, Unit>(n));
+        return conversion::ok;
+    }
+    double x;
+    conversion c = convert_floating(number, x);
+    if (c != conversion::ok)
+        return c;
+    auto d = std::chrono::duration<double, Unit>(x);
+    if (std::is_integral_v<Rep>
+        && !(std::fabs(std::chrono::duration<double, Period>(d).count())
+             < double(std::numeric_limits<Rep>::max())))
+        return conversion::out_of_range;
+    value = std::chrono::duration_cast<D>(d);
+    return conversion::ok;
+}
+
+template<typename Rep, typename Period>
+conversion convert_duration(
+    std::string_view s, std::chrono::duration<Rep, Period>& value)
+{
+    auto unit = [&s](std::string_view u) {
+        if (s.size() > u.size() && s.substr(s.size() - u.size()) == u) {
+            s.remove_suffix(u.size());
+            return true;
+        }
+        return false;
+    };
+    // "ns", "us" and "ms" are tested before "s", "min" before "n"
+    if (unit("ns"))
+        return make_duration<Rep, Period, std::nano>(s, value);
+    if (unit("us"))
+        return make_duration<Rep, Period, std::micro>(s, value);
+    if (unit("ms"))
+        return make_duration<Rep, Period, std::milli>(s, value);
+    if (unit("min"))
+        return make_duration<Rep, Period, std::ratio<60>>(s, value);
+    if (unit("s"))
+        return make_duration<Rep, Period, std::ratio<1>>(s, value);
+    if (unit("h"))
+        return make_duration<Rep, Period, std::ratio<3600>>(s, value);
+    if (unit("d"))
+        return make_duration<Rep, Period, std::ratio<86400>>(s, value);
+    return conversion::invalid;
+}
+
+} // namespace detail
+
+template<typename T>
+conversion convert(
+    std::string_view s, T& value)
+{
+    if constexpr (std::is_same_v<T, bool>)
+        return detail::convert_bool(s, value);
+    else if constexpr (std::is_integral_v<T>)
+        return detail::convert_integer(s, value);
+    else if constexpr (std::is_floating_point_v<T>)
+        return detail::convert_floating(s, value);
+    else {
+        static_assert(is_duration<T>::value, "minion::convert: unsupported type");
+        return detail::convert_duration(s, value);
+    }
+}
+
+#ifdef MINION_CONVERSION_CACHE
+
+// The result of the last conversion of a string
+struct conversion_cache
+{
+    enum : uint8_t { None, Signed, Unsigned, Floating, Boolean } kind{None};
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        bool b;
+    };
+};
+
+// Convert using the cache. Integers are cached as 64-bit values, floating
+// point numbers as `double`. Durations are not cached.
+template<typename T>
+conversion convert(
+    std::string_view s, T& value, conversion_cache& cache)
+{
+    if constexpr (std::is_same_v<T, bool>) {
+        if (cache.kind != conversion_cache::Boolean) {
+            if (conversion c = detail::convert_bool(s, cache.b); c != conversion::ok)
+                return c;
+            cache.kind = conversion_cache::Boolean;
+        }
+        value = cache.b;
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+        if (cache.kind != conversion_cache::Signed) {
+            int64_t v;
+            if (conversion c = detail::convert_integer(s, v); c != conversion::ok)
+                return c;
+            cache.i = v;
+            cache.kind = conversion_cache::Signed;
+        }
+        if (cache.i < std::numeric_limits<T>::min() || cache.i > std::numeric_limits<T>::max())
+            return conversion::out_of_range;
+        value = T(cache.i);
+    } else if constexpr (std::is_integral_v<T>) {
+        if (cache.kind != conversion_cache::Unsigned) {
+            uint64_t v;
+            if (conversion c = detail::convert_integer(s, v); c != conversion::ok)
+                return c;
+            cache.u = v;
+            cache.kind = conversion_cache::Unsigned;
+        }
+        if (cache.u > std::numeric_limits<T>::max())
+            return conversion::out_of_range;
+        value = T(cache.u);
+    } else if constexpr (std::is_same_v<T, double>) {
+        if (cache.kind != conversion_cache::Floating) {
+            double v;
+            if (conversion c = detail::convert_floating(s, v); c != conversion::ok)
+                return c;
+            cache.d = v;
+            cache.kind = conversion_cache::Floating;
+        }
+        value = cache.d;
+    } else
+        return convert(s, value);
+    return conversion::ok;
+}
+
+#endif
+
+} // namespace minion
+
+#endif // CONVERT_H
@@ -0,0 +1,82 @@
+#include "filedata.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace minion {
+
+FileData::~FileData()
+{
+    if (mapped)
+        munmap(const_cast<char*>(data), size);
+}
+
+// Read the whole file into `buffer`. `pread` is used where possible, as
+// it doesn't depend on (or change) the file position; pipes and other
+// unseekable files must be read sequentially.
+static bool read_all(
+    int fd, std::string& buffer)
+{
+    size_t n = 0;
+    bool seekable = true;
+    buffer.resize(64 * 1024);
+    while (true) {
+        if (n == buffer.size())
+            buffer.resize(buffer.size() * 2);
+        ssize_t k;
+        if (seekable) {
+            k = pread(fd, buffer.data() + n, buffer.size() - n, n);
+            if (k < 0 && errno == ESPIPE) {
+                seekable = false;
+                continue;
+            }
+        } else
+            k = read(fd, buffer.data() + n, buffer.size() - n);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (k == 0)
+            break;
+        n += k;
+    }
+    buffer.resize(n);
+    return true;
+}
+
+std::shared_ptr<FileData> read_file(
+    const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    auto f = std::make_shared<FileData>();
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            // The parser reads the file from start to end, once
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            f->data = static_cast<const char*>(p);
+            f->size = st.st_size;
+            f->mapped = true;
+            close(fd);
+            return f;
+        }
+    }
+    if (!read_all(fd, f->buffer)) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return nullptr;
+    }
+    close(fd);
+    f->data = f->buffer.data();
+    f->size = f->buffer.size();
+    return f;
+}
+
+} // namespace minion
@@ -0,0 +1,38 @@
+#ifndef FILEDATA_H
+#define FILEDATA_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace minion {
+
+/* The contents of a file, for reading. A regular file is mapped into
+ * memory (read-only), other files (pipes, devices, etc.) are read into
+ * a buffer. The data remains valid as long as the `FileData` exists.
+ */
+class FileData
+{
+    const char* data{nullptr};
+    size_t size{0};
+    bool mapped{false};
+    std::string buffer; // used if the file is not mapped
+
+    friend std::shared_ptr<FileData> read_file(const std::string& path);
+
+public:
+    FileData() = default;
+    FileData(const FileData&) = delete;
+    FileData& operator=(const FileData&) = delete;
+    ~FileData();
+
+    std::string_view view() { return {data, size}; }
+};
+
+// Return the contents of the given file, or a null pointer if it could
+// not be read (`errno` is then set).
+std::shared_ptr<FileData> read_file(const std::string& path);
+
+} // namespace minion
+
+#endif // FILEDATA_H
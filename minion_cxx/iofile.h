@@ -1,12 +0,0 @@
-#ifndef IOFILE_H
-#define IOFILE_H
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-const char *read_file(const char *filepath);
-
-#ifdef __cplusplus
-}
-#endif
-#endif // IOFILE_H
@@ -0,0 +1,105 @@
+/* Test of macros: values shared between uses, and macros defined as
+ * aliases of other macros, in both MinionValue and Document modes, and a
+ * macro library used by several threads at once (mainly of use in a
+ * build with ThreadSanitizer, -fsanitize=thread).
+ */
+
+#include "minion.h"
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace minion;
+
+namespace {
+
+int failures = 0;
+
+void check(
+    const char* what, bool ok)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok)
+        ++failures;
+}
+
+// Read `input` in both modes, comparing the result with `expected`
+void check_read(
+    const char* input, const char* expected)
+{
+    InputBuffer ib;
+    DumpBuffer db;
+    MinionValue m;
+    const char* e = ib.read(m, input);
+    check(input, !e && std::string{db.dump(m)} == expected);
+    Document d;
+    e = ib.read(d, input);
+    check(input, !e && std::string{db.dump(d.value())} == expected);
+}
+
+// Read documents using the map of `lib` on several threads, searching it
+// and freeing the documents again (which changes its reference count)
+bool read_with_library(
+    MacroLibrary& lib, int n_keys)
+{
+    std::atomic<int> bad{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            InputBuffer ib;
+            std::string s;
+            for (int round = 0; round < 100; ++round) {
+                MinionValue m;
+                MList* ml;
+                if (ib.read(m, "[&L, &L]", lib) || !(ml = m.m_list()) || ml->size() != 2) {
+                    ++bad;
+                    continue;
+                }
+                MMap* mm = ml->get(round % 2).m_map();
+                for (int i = 0; i < n_keys; ++i) {
+                    if (!mm || !mm->get_string("k" + std::to_string(i), s)
+                        || s != "v" + std::to_string(i))
+                        ++bad;
+                }
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    return bad == 0;
+}
+
+} // namespace
+
+int main()
+{
+    check_read("&M0: [a, b], &M1: &M0, {k: &M1, j: &M0}", R"({"k":["a","b"],"j":["a","b"]})");
+    check_read("&M0: {x: y}, &M1: &M0, &M2: &M1, [&M2, &M1]", R"([{"x":"y"},{"x":"y"}])");
+    check_read("&S: s, &T: &S, [&T, &S]", R"(["s","s"])");
+    check_read("&L: \"a string which is longer than a short one\", &A: &L, [&A]",
+               R"(["a string which is longer than a short one"])");
+
+    // An alias shares the value of the macro it names
+    InputBuffer ib;
+    MinionValue m;
+    ib.read(m, "&M0: [a, b], &M1: &M0, {k: &M1, j: &M0}");
+    MMap* mm = m.m_map();
+    check("alias shares the value",
+          mm && mm->get("k").is_shared() && mm->get("k").m_list() == mm->get("j").m_list());
+
+    // Unknown macros are still reported
+    check("unknown alias", ib.read(m, "&M1: &M0, [&M1]") != nullptr);
+
+    // A library shared between threads
+    std::string defs = "&L: {";
+    for (int i = 0; i < 40; ++i)
+        defs.append("k" + std::to_string(i) + ": v" + std::to_string(i) + ", ");
+    defs.append("},");
+    MacroLibrary lib;
+    check("library", !ib.read(lib, defs) && lib.get("&L").m_map());
+    check("library used by several threads", read_with_library(lib, 40));
+
+    return failures == 0 ? 0 : 1;
+}
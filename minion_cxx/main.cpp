@@ -1,4 +1,4 @@
-#include "iofile.h"
+#include "filedata.h"
 #include "minion.h"
 #include <cstdio>
 #include <cstdlib>
@@ -20,22 +20,24 @@ int main()
         //
     };
 
-    std::string indata;
+    std::shared_ptr<FileData> file;
+    std::string_view indata;
 
     struct timespec start, end, xtra;
 
     InputBuffer miniondata;
 
     MinionValue m;
+    Document doc; // for arena allocation
 
     for (int count = 0; count < 10; ++count) {
         for (const auto& fp : fplist) {
-            const char* f = read_file(fp);
-            if (!f) {
+            file = read_file(fp);
+            if (!file) {
                 printf("File not found: %s\n", fp);
                 exit(1);
             }
-            indata = f;
+            indata = file->view();
 
             clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start); // Initial timestamp
 
@@ -47,13 +49,31 @@ int main()
 
             clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &xtra); // Get current time
 
-            double elapsed = end.tv_sec - start.tv_sec;
+            double elapsed = (end.tv_sec - start.tv_sec) * 1e6;
             elapsed += (end.tv_nsec - start.tv_nsec) / 1000.0;
             printf("%0.2f microseconds elapsed\n", elapsed);
 
-            elapsed = xtra.tv_sec - end.tv_sec;
+            elapsed = (xtra.tv_sec - end.tv_sec) * 1e6;
             elapsed += (xtra.tv_nsec - end.tv_nsec) / 1000.0;
             printf("%0.2f microseconds freeing\n", elapsed);
+
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+
+            miniondata.read(doc, file);
+
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+
+            doc.clear();
+
+            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &xtra);
+
+            elapsed = (end.tv_sec - start.tv_sec) * 1e6;
+            elapsed += (end.tv_nsec - start.tv_nsec) / 1000.0;
+            printf("%0.2f microseconds elapsed (arena)\n", elapsed);
+
+            elapsed = (xtra.tv_sec - end.tv_sec) * 1e6;
+            elapsed += (xtra.tv_nsec - end.tv_nsec) / 1000.0;
+            printf("%0.2f microseconds freeing (arena)\n", elapsed);
         }
         printf("  - - - - -\n");
     }
@@ -1,4 +1,5 @@
 #include "minion.h"
+#include <cctype>
 #include <map>
 
 namespace minion {
@@ -58,49 +59,109 @@ const inline std::map<int, std::string> seek_message = {{T_NoType, "top-level va
 
 /* *** Macros ***
  * 
- * Macros use a special flag within `MValue` to allow their data structures
- * to be shared by all references to them. The macros are built in a
- * separate map structure (name string -> `MValue`). When a macro is used
- * in the MINION source, its `MValue` is (shallow) copied to the new place.
- * Immediately after this, the special "not owner" flag is set on the
- * `MValue` in the macro map. When the macro is used again, this flag will
- * be copied to the new place with the `MValue`, so that the destructor
- * will skip this node. Ownership is effectively transferred to the new
- * place.
- * 
- * Should any macros remain unused, their entry in the macro map will not
- * have the "not owner" flag set, so these entries must be deleted
- * separately after the parsing is complete.
+ * The value of a macro is built once, as an immutable subtree which is
+ * shared by all references to it. The macros are built in a separate map
+ * structure (name string -> `MValue`). The top node of a macro's value is
+ * allocated as a `Shared` node, which has an (atomic) reference count – a
+ * `MacroLibrary` may be used by documents on several threads – and the
+ * `MValue`s referring to it – the one in the macro map and one at each
+ * place where the macro is used – have the "shared" flag set. Freeing such
+ * an `MValue` only reduces the count; the subtree is freed with the last
+ * reference. The macro map's references are dropped after the parsing is
+ * complete, so that the values of unused macros are then freed.
+ * A string is not shared: it is small enough to be copied to each use,
+ * except that a long string's data may be shared where it outlives the
+ * uses (see `get_macro`).
+ *
+ * A deep copy keeps the sharing: each shared subtree is copied once, the
+ * other references to it referring to the copy. The serializer also
+ * serializes a shared subtree only once (for each indentation depth at
+ * which it occurs) and then copies the result.
  */
 
+namespace {
+
+template<typename T>
+struct Shared : T
+{
+    using T::T;
+    std::atomic<size_t> refs{1};
+};
+
+template<typename T>
+void release(
+    T* node)
+{
+    auto s = static_cast<Shared<T>*>(node);
+    if (--s->refs == 0)
+        delete s;
+}
+
+} // namespace
+
+std::atomic<size_t>& MValue::share_count()
+{
+    switch (type) {
+    case T_List:
+        return static_cast<Shared<MList>*>(m_list())->refs;
+    case T_Map:
+        return static_cast<Shared<MMap>*>(m_map())->refs;
+    default:
+        throw "[BUG] Invalid shared MValue";
+    }
+}
+
 // +++ Deep copy of MValue +++
 // This must build in-place to avoid potential memory leaks.
 void MValue::copy(
     MinionValue& m)
 {
-    mcopy(m);
+    shared_copies copies;
+    mcopy(m, copies);
 }
 
 void MValue::mcopy(
-    MValue& m)
+    MValue& m, shared_copies& copies)
 {
+    if (shared) {
+        auto it = copies.find(minion_item());
+        if (it != copies.end()) {
+            m = {type, it->second, true};
+            ++m.share_count();
+            return;
+        }
+    }
     switch (type) {
     case T_String:
-        m = new MString(*m_string());
+        m = string.data_view();
         break;
-    case T_List:
-        m = new MList(*m_list());
+    case T_List: {
+        MList* source = m_list();
+        if (shared)
+            m = {T_List, new Shared<MList>, true};
+        else
+            m = new MList;
+        MList* ml = m.m_list();
+        size_t len = source->size();
+        for (size_t i = 0; i < len; ++i) {
+            ml->add({});
+            source->get(i).mcopy(ml->get(i), copies);
+        }
         break;
+    }
     case T_Map: {
-        auto mmap = new MMap;
-        m = {T_Map, mmap};
-        auto mm = m.m_map();
-        size_t len = mm->size();
+        MMap* source = m_map();
+        if (shared)
+            m = {T_Map, new Shared<MMap>, true};
+        else
+            m = new MMap;
+        MMap* mm = m.m_map();
+        size_t len = source->size();
         for (size_t i = 0; i < len; ++i) {
-            MPair& mp0 = mm->get_pair(i);
-            mmap->add({mp0.first, {}});
-            MValue& mref = mmap->get_pair(i).second;
-            mp0.second.mcopy(mref);
+            MPair& mp0 = source->get_pair(i);
+            mm->add({mp0.first, {}});
+            MValue& mref = mm->get_pair(i).second;
+            mp0.second.mcopy(mref, copies);
         }
         break;
     };
@@ -108,48 +169,150 @@ void MValue::mcopy(
         // This is unexpected ...
         throw "[BUG] Invalid MValue whilst copying";
     }
+    if (shared)
+        copies.emplace(minion_item(), m.minion_item());
 }
 
 void MValue::free()
 {
-    if (not_owner)
-        return;
     switch (type) {
     case T_String:
-        delete m_string();
+        string.release();
         break;
     case T_List:
-        delete m_list();
+        if (shared)
+            release(m_list());
+        else
+            delete m_list();
         break;
     case T_Map:
-        delete m_map();
+        if (shared)
+            release(m_map());
+        else
+            delete m_map();
         break;
     }
 }
 
-// Read a string as in `int` value, taking an optional context string
-// for error reports.
-int string2int(
-    std::string& s, std::string_view context = "")
+void MapIndex::sync(
+    const std::pmr::vector<MPair>& pairs)
 {
-    int i;
-    try {
-        size_t index;
-        i = std::stoi(s, &index, 0);
-        if (index != s.size())
-            throw "";
-    } catch (std::out_of_range& e) {
-        std::string msg{"Integer out of range: " + s};
-        if (!context.empty())
-            msg.append("\n  context: ").append(context);
-        throw MinionError(msg);
-    } catch (...) {
-        std::string msg{"Invalid integer: " + s};
-        if (!context.empty())
-            msg.append("\n  context: ").append(context);
-        throw MinionError(msg);
+    size_t n = pairs.size();
+    if (n < n_indexed || n * 2 > slots.size()) {
+        // (Re)build the table, keeping it at most half full
+        size_t capacity = 64;
+        while (capacity < n * 2)
+            capacity *= 2;
+        slots.assign(capacity, {0, 0});
+        n_indexed = 0;
+    }
+    size_t mask = slots.size() - 1;
+    for (; n_indexed < n; ++n_indexed) {
+        std::string_view key = pairs[n_indexed].first;
+        size_t h = std::hash<std::string_view>{}(key);
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            slot& s = slots[i];
+            if (s.pos == 0) {
+                s = {uint32_t(h), uint32_t(n_indexed + 1)};
+                break;
+            }
+            if (s.hash == uint32_t(h) && pairs[s.pos - 1].first == key)
+                break; // a repeated key, the first entry is retained
+        }
+    }
+}
+
+int MapIndex::find(
+    const std::pmr::vector<MPair>& pairs, std::string_view key) const
+{
+    if (slots.empty()) {
+        int i = 0;
+        for (auto& mp : pairs) {
+            if (mp.first == key)
+                return i;
+            ++i;
+        }
+        return -1;
     }
-    return i;
+    size_t h = std::hash<std::string_view>{}(key);
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        const slot& s = slots[i];
+        if (s.pos == 0)
+            return -1;
+        if (s.hash == uint32_t(h) && pairs[s.pos - 1].first == key)
+            return s.pos - 1;
+    }
+}
+
+// *** Arena ***
+
+void* Arena::do_allocate(
+    size_t bytes, size_t alignment)
+{
+    while (true) {
+        if (next) {
+            char* p = reinterpret_cast<char*>(
+                (reinterpret_cast<uintptr_t>(next) + alignment - 1) & ~(alignment - 1));
+            if (p + bytes <= end) {
+                next = p + bytes;
+                return p;
+            }
+            ++current;
+        }
+        if (current < chunks.size()) {
+            // Reuse a chunk retained by `reset`
+            next = chunks[current].first;
+            end = next + chunks[current].second;
+            continue;
+        }
+        // Add a new chunk, making each one larger than the last so that
+        // there are only ever a few of them
+        size_t size = chunk_size;
+        while (size < bytes + alignment)
+            size *= 2;
+        if (chunk_size < (1 << 24))
+            chunk_size *= 2;
+        next = static_cast<char*>(::operator new(size));
+        end = next + size;
+        chunks.emplace_back(next, size);
+    }
+}
+
+void Arena::reset()
+{
+    current = 0;
+    if (chunks.empty()) {
+        next = nullptr;
+        end = nullptr;
+    } else {
+        next = chunks[0].first;
+        end = next + chunks[0].second;
+    }
+}
+
+void Arena::release()
+{
+    for (auto& ch : chunks)
+        ::operator delete(ch.first);
+    chunks.clear();
+    current = 0;
+    next = nullptr;
+    end = nullptr;
+}
+
+// Report a failed conversion of a string value
+std::string conversion_message(
+    conversion c, std::string_view s, const char* what)
+{
+    std::string msg;
+    if (c == conversion::out_of_range) {
+        msg = what;
+        msg[0] = std::toupper(msg[0]);
+        msg.append(" out of range: ");
+    } else
+        msg.append("Invalid ").append(what).append(": ");
+    return msg.append(s).append("\n  context: ");
 }
 
 // Represent number as a string with hexadecimal digits, at least minwidth.
@@ -173,7 +336,7 @@ char InputBuffer::read_ch(
 {
     if (ch_index >= input.size())
         return 0;
-    char ch = input.at(ch_index);
+    char ch = input[ch_index];
     ++ch_index;
     if (ch == '\n') {
         ++line_index;
@@ -231,21 +394,29 @@ void InputBuffer::error(
     throw MinionError(mx);
 }
 
+// The result is available in `string_item`, which refers to the input.
 void InputBuffer::get_bare_string(
     char ch)
 {
-    ch_buffer.clear();
+    size_t start = ch_index - 1; // `ch` has already been read
+    string_in_input = true;
     while (true) {
-        ch_buffer.push_back(ch);
+        // Skip any following run of ordinary characters in one step
+        ch_index = scanner.find(ch_index, C_Space | C_Control | C_Quote | C_Structural);
         switch (ch = read_ch(false)) {
         case ':':
         case ',':
         case ']':
         case '}':
             unread_ch();
+            string_item = input.substr(start, ch_index - start);
+            return;
         case ' ':
         case '\n':
+            string_item = input.substr(start, ch_index - 1 - start);
+            return;
         case 0:
+            string_item = input.substr(start, ch_index - start);
             return;
         case '{':
         case '[':
@@ -259,7 +430,7 @@ void InputBuffer::get_bare_string(
     }
 }
 
-// The result is available in `ch_buffer`.
+// The result is available in `string_item`.
 void InputBuffer::get_string(
     char ch)
 {
@@ -271,9 +442,17 @@ void InputBuffer::get_string(
     // +++ a delimited string (terminated by '"')
     // Escapes, introduced by '\', are possible. These are an extension
     // of the JSON escapes – see the MINION specification.
-    ch_buffer.clear();
+    // Until an escape is found, the string is just a section of the input.
+    // Only then is it copied to `ch_buffer`, where the escapes are decoded.
+    size_t start = ch_index;
+    string_in_input = true;
     position start_pos = here();
     while (true) {
+        // Take any run of characters needing no special treatment in one step
+        size_t end = scanner.find(ch_index, C_Quote | C_Control);
+        if (!string_in_input)
+            ch_buffer.append(input, ch_index, end - ch_index);
+        ch_index = end;
         ch = read_ch(true);
         if (ch == '"')
             break;
@@ -282,6 +461,10 @@ void InputBuffer::get_string(
                       .append(pos(start_pos)));
         }
         if (ch == '\\') {
+            if (string_in_input) {
+                ch_buffer.assign(input, start, ch_index - 1 - start);
+                string_in_input = false;
+            }
             ch = read_ch(false); // '\n' etc. are permitted here
             switch (ch) {
             case '"':
@@ -334,6 +517,7 @@ void InputBuffer::get_string(
                                       .append(pos(comment_pos)));
                         }
                         // loop with next character
+                        ch_index = scanner.find(ch_index, C_Quote | C_Control);
                         ch = read_ch(false);
                     }
                 }
@@ -344,6 +528,38 @@ void InputBuffer::get_string(
         }
         ch_buffer.push_back(ch);
     }
+    if (string_in_input)
+        string_item = input.substr(start, ch_index - 1 - start);
+    else
+        string_item = ch_buffer;
+}
+
+// Make a new string value for `string_item`. In zero-copy mode, a long
+// string which is just a section of the input is not copied.
+MValue InputBuffer::new_string()
+{
+    MValue m;
+    m.type = T_String;
+    m.string.set(string_item, zero_copy && string_in_input, arena);
+    return m;
+}
+
+// A use of a macro's value. A list or map is shared, a string is copied –
+// though a long string's data is only copied if it might not outlive the
+// use, i.e. if it is owned by the macro and the result is not in an arena.
+MValue InputBuffer::macro_value(
+    MValue& mp, bool count)
+{
+    if (mp.type == T_String) {
+        if (!arena && (mp.string.tag & MString::owned))
+            return mp.string.data_view();
+        MValue m = mp;
+        m.string.tag &= ~MString::owned;
+        return m;
+    }
+    if (count)
+        ++mp.share_count();
+    return mp;
 }
 
 MValue InputBuffer::get_macro(
@@ -351,15 +567,24 @@ MValue InputBuffer::get_macro(
 {
     auto i = macro_map.search(s);
     if (i < 0) {
+        if (library) {
+            // A `Document` doesn't hold the library's values
+            i = library->macros.search(s);
+            if (i >= 0)
+                return macro_value(library->macros.get_pair(i).second, !arena);
+        }
         error(std::string("Unknown macro name: ")
-                  .append(ch_buffer)
+                  .append(s)
                   .append(" ... current position ")
                   .append(pos(here())));
     }
     MValue& mp = macro_map.get_pair(i).second;
-    MValue m = mp;
-    mp.not_owner = true;
-    return m;
+    return macro_value(mp, mp.shared);
+}
+
+void InputBuffer::library_value_error()
+{
+    error(std::string("Unexpected value in macro library at position ").append(pos(here())));
 }
 
 /* Read the next "item" from the input.
@@ -377,11 +602,13 @@ void InputBuffer::get_item(
 {
     char ch;
     while (true) {
+        ch_index = scanner.skip_space(ch_index, line_index, ch_linestart);
         switch (ch = read_ch(false)) {
             // Act according to the next input character.
 
         case 0: // end of input, no next item
-            if (expect != Expect_End) {
+            // (a macro library has no top-level value)
+            if (expect != Expect_End && !(new_library && mvalue.type == T_NoType)) {
                 error(std::string("Unexpected end of input data while reading ")
                           .append(seek_message.at(mvalue.type)));
             }
@@ -429,32 +656,32 @@ void InputBuffer::get_item(
                 case T_NoType: // top-level, macro key definition
                     get_bare_string(ch);
                     // check that the key is unique
-                    if (macro_map.search(ch_buffer) >= 0) {
+                    if (macro_map.search(string_item) >= 0) {
                         error(std::string("Macro key has already been defined: ")
-                                  .append(ch_buffer)
+                                  .append(string_item)
                                   .append(" ... current position ")
                                   .append(pos(here())));
                     }
-                    macro_map.add({ch_buffer, MValue{T_Macro, nullptr}});
+                    macro_map.add(string_item, MValue{T_Macro, nullptr});
                     get_item(macro_map.get_pair(macro_map.size() - 1).second, Expect_Colon);
                     expect = Expect_Comma;
                     continue;
 
                 case T_Macro: // top-level, macro value definition
+                    // An alias of another macro shares its value
                     get_bare_string(ch);
-                    mvalue = get_macro(ch_buffer);
-                    expect = Expect_Comma;
-                    continue;
+                    mvalue = get_macro(string_item);
+                    return;
 
                 case T_List: // list value
                     get_bare_string(ch);
-                    mvalue.m_list()->add(get_macro(ch_buffer));
+                    mvalue.m_list()->add(get_macro(string_item));
                     expect = Expect_Comma;
                     continue;
 
                 case T_Pair: // map value                {
                     get_bare_string(ch);
-                    mvalue = get_macro(ch_buffer);
+                    mvalue = get_macro(string_item);
                     return;
                 }
             }
@@ -465,7 +692,9 @@ void InputBuffer::get_item(
             if (expect == Expect_Value) {
                 switch (mvalue.type) {
                 case T_NoType: // top-level value
-                    mvalue = new MList();
+                    if (new_library)
+                        library_value_error();
+                    mvalue = new_node<MList>();
                     get_item(mvalue);
                     // No further input expected
                     expect = Expect_End;
@@ -473,7 +702,7 @@ void InputBuffer::get_item(
 
                 case T_List: // list value
                 {
-                    MValue m = new MList();
+                    MValue m = new_node<MList>();
                     mvalue.m_list()->add(m);
                     get_item(m);
                     expect = Expect_Comma;
@@ -482,14 +711,14 @@ void InputBuffer::get_item(
 
                 case T_Pair: // map value                {
                 {
-                    mvalue = new MList();
+                    mvalue = new_node<MList>();
                     get_item(mvalue);
                     return;
                 }
 
                 case T_Macro: // top-level, macro value definition
                 {
-                    mvalue = new MList();
+                    mvalue = {T_List, new_node<Shared<MList>>(), true};
                     get_item(mvalue);
                     return;
                 }
@@ -502,14 +731,16 @@ void InputBuffer::get_item(
             if (expect == Expect_Value) {
                 switch (mvalue.type) {
                 case T_NoType: // top-level value
-                    mvalue = {T_Map, new MMap()};
+                    if (new_library)
+                        library_value_error();
+                    mvalue = {T_Map, new_node<MMap>()};
                     get_item(mvalue);
                     // No further input expected
                     expect = Expect_End;
                     continue;
                 case T_List: // list value
                 {
-                    MValue m = {T_Map, new MMap()};
+                    MValue m = {T_Map, new_node<MMap>()};
                     mvalue.m_list()->add(m);
                     get_item(m);
                     expect = Expect_Comma;
@@ -517,14 +748,14 @@ void InputBuffer::get_item(
                 }
                 case T_Pair: // map value                {
                 {
-                    mvalue = {T_Map, new MMap()};
+                    mvalue = {T_Map, new_node<MMap>()};
                     get_item(mvalue);
                     return;
                 }
 
                 case T_Macro: // top-level, macro value definition
                 {
-                    mvalue = {T_Map, new MMap()};
+                    mvalue = {T_Map, new_node<Shared<MMap>>(), true};
                     get_item(mvalue);
                     return;
                 }
@@ -552,6 +783,7 @@ void InputBuffer::get_item(
                                   .append(pos(comment_pos)));
                     }
                     // Comment loop ... read next character
+                    ch_index = scanner.find(ch_index, C_Structural | C_Control);
                     ch = read_ch(false);
                 }
                 // End of extended comment
@@ -561,6 +793,7 @@ void InputBuffer::get_item(
                     if (ch == '\n' || ch == 0) {
                         break;
                     }
+                    ch_index = scanner.find(ch_index, C_Control);
                     ch = read_ch(false);
                 }
             }
@@ -571,8 +804,10 @@ void InputBuffer::get_item(
             if (expect == Expect_Value) {
                 switch (mvalue.type) {
                 case T_NoType: // top-level value
+                    if (new_library)
+                        library_value_error();
                     get_string(ch);
-                    mvalue = new MString(ch_buffer);
+                    mvalue = new_string();
                     // No further input expected
                     expect = Expect_End;
                     continue;
@@ -581,13 +816,13 @@ void InputBuffer::get_item(
                     get_string(ch);
                     // check that the key is unique
                     auto mm = mvalue.m_map();
-                    if (mm->search(ch_buffer) >= 0) {
+                    if (mm->search(string_item) >= 0) {
                         error(std::string("Map key has already been defined: ")
-                                  .append(ch_buffer)
+                                  .append(string_item)
                                   .append(" ... current position ")
                                   .append(pos(here())));
                     }
-                    mm->add({ch_buffer, {T_Pair, {}}});
+                    mm->add(string_item, {T_Pair, {}});
                     MValue& m = mm->get_pair(mm->size() - 1).second;
                     get_item(m, Expect_Colon);
                     expect = Expect_Comma;
@@ -595,16 +830,16 @@ void InputBuffer::get_item(
                 }
                 case T_List: // list value
                     get_string(ch);
-                    mvalue.m_list()->add(new MString{ch_buffer});
+                    mvalue.m_list()->add(new_string());
                     expect = Expect_Comma;
                     continue;
                 case T_Pair: // map value                {
                     get_string(ch);
-                    mvalue = new MString(ch_buffer);
+                    mvalue = new_string();
                     return;
                 case T_Macro:
                     get_string(ch);
-                    mvalue = new MString(ch_buffer);
+                    mvalue = new_string();
                     return;
                 }
             }
@@ -656,29 +891,36 @@ bool InputBuffer::add_unicode_to_ch_buffer(
     return true;
 }
 
-const char* InputBuffer::read(
-    MinionValue& data, std::string_view input_string)
+void InputBuffer::clear_macros()
+{
+    if (arena)
+        macro_map.reset();
+    else
+        macro_map.clear();
+}
+
+// Parse the input into `data`, which should be empty. If the parse fails,
+// `data` may be left partially built, it is up to the caller to free it.
+const char* InputBuffer::parse(
+    MValue& data, std::string_view input_string)
 {
     // Prepare input buffer
     input = input_string;
     ch_index = 0;
     line_index = 0;
     ch_linestart = 0;
+    scanner.reset(input);
 
-    // Clear result data, just to be sure ...
-    data = {};
-    macro_map.clear();
+    clear_macros();
 
     try {
         get_item(data);
     } catch (MinionError& e) {
-        data = {};
-        macro_map.clear();
+        clear_macros();
         error_message = e.what();
         return error_message.c_str();
     } catch (...) {
-        data = {};
-        macro_map.clear();
+        clear_macros();
         throw;
     }
 
@@ -690,87 +932,173 @@ const char* InputBuffer::read(
     }
     */
 
-    macro_map.clear();
+    if (new_library)
+        new_library->macros.swap(macro_map);
+    clear_macros();
     return nullptr;
 }
 
+const char* InputBuffer::read(
+    MinionValue& data, std::string_view input_string)
+{
+    // Clear result data, just to be sure ...
+    data = {};
+    const char* e;
+    try {
+        e = parse(data, input_string);
+    } catch (...) {
+        data = {};
+        throw;
+    }
+    if (e)
+        data = {};
+    return e;
+}
+
+// Any file data held by the document is retained: `input_string` may
+// refer to it.
+const char* InputBuffer::read(
+    Document& doc, std::string_view input_string)
+{
+    doc.reset();
+    arena = &doc.arena;
+    const char* e;
+    try {
+        e = parse(doc.root, input_string);
+    } catch (...) {
+        arena = nullptr;
+        doc.reset();
+        throw;
+    }
+    arena = nullptr;
+    if (e)
+        doc.reset();
+    return e;
+}
+
+const char* InputBuffer::read(
+    Document& doc, std::shared_ptr<FileData> file)
+{
+    doc.reset();
+    doc.source = std::move(file);
+    return read(doc, doc.source->view());
+}
+
+const char* InputBuffer::read(
+    MacroLibrary& lib, std::string_view input_string)
+{
+    lib.macros.clear();
+    MinionValue data; // remains empty
+    bool zc = zero_copy;
+    zero_copy = false; // the input need not be kept
+    new_library = &lib;
+    const char* e;
+    try {
+        e = parse(data, input_string);
+    } catch (...) {
+        zero_copy = zc;
+        new_library = nullptr;
+        throw;
+    }
+    zero_copy = zc;
+    new_library = nullptr;
+    return e;
+}
+
+const char* InputBuffer::read(
+    MinionValue& data, std::string_view input_string, MacroLibrary& lib)
+{
+    library = &lib;
+    const char* e;
+    try {
+        e = read(data, input_string);
+    } catch (...) {
+        library = nullptr;
+        throw;
+    }
+    library = nullptr;
+    return e;
+}
+
+const char* InputBuffer::read(
+    Document& doc, std::string_view input_string, MacroLibrary& lib)
+{
+    library = &lib;
+    const char* e;
+    try {
+        e = read(doc, input_string);
+    } catch (...) {
+        library = nullptr;
+        throw;
+    }
+    library = nullptr;
+    return e;
+}
+
 void DumpBuffer::dump_string(
     MString& source)
 {
     dump_string(source.data_view());
 }
 
+// The serialized forms of the characters which must be escaped in strings
+struct escape_table
+{
+    struct entry
+    {
+        char text[6];
+        unsigned char len; // 0 if the character needs no escape
+    };
+    entry e[256];
+
+    constexpr escape_table()
+        : e{}
+    {
+        const char* hex = "0123456789ABCDEF";
+        for (int ch = 0; ch < 256; ++ch) {
+            if (ch < 32 || ch == 127)
+                e[ch] = {{'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15]}, 6};
+        }
+        e[(unsigned char) '"'] = {{'\\', '"'}, 2};
+        e[(unsigned char) '\\'] = {{'\\', '\\'}, 2};
+        e[(unsigned char) '\n'] = {{'\\', 'n'}, 2};
+        e[(unsigned char) '\t'] = {{'\\', 't'}, 2};
+        e[(unsigned char) '\b'] = {{'\\', 'b'}, 2};
+        e[(unsigned char) '\f'] = {{'\\', 'f'}, 2};
+        e[(unsigned char) '\r'] = {{'\\', 'r'}, 2};
+    }
+};
+
+constexpr escape_table escapes;
+
+// Runs of characters which need no escaping are found by `find_escape`
+// and copied in one step.
 void DumpBuffer::dump_string(
     std::string_view source)
 {
     add('"');
-    for (unsigned char ch : source) {
-        switch (ch) {
-        case '"':
-            add('\\');
-            add('"');
-            break;
-        case '\n':
-            add('\\');
-            add('n');
-            break;
-        case '\t':
-            add('\\');
-            add('t');
-            break;
-        case '\b':
-            add('\\');
-            add('b');
-            break;
-        case '\f':
-            add('\\');
-            add('f');
-            break;
-        case '\r':
-            add('\\');
-            add('r');
-            break;
-        case '\\':
-            add('\\');
-            add('\\');
-            break;
-        case 127:
-            add('\\');
-            add('u');
-            add('0');
-            add('0');
-            add('7');
-            add('F');
+    size_t start = 0;
+    while (true) {
+        size_t i = find_escape(source, start);
+        sink->write(source.substr(start, i - start));
+        if (i == source.size())
             break;
-        default:
-            if (ch >= 32) {
-                add(ch);
-            } else {
-                add('\\');
-                add('u');
-                add('0');
-                add('0');
-                if (ch >= 16) {
-                    add('1');
-                    ch -= 16;
-                } else
-                    add('0');
-                if (ch >= 10)
-                    add('A' + ch - 10);
-                else
-                    add('0' + ch);
-            }
-        }
+        auto& esc = escapes.e[(unsigned char) source[i]];
+        sink->write({esc.text, esc.len});
+        start = i + 1;
     }
     add('"');
 }
 
 void DumpBuffer::dump_pad()
 {
+    static const std::string spaces(64, ' ');
     if (depth >= 0) {
         add('\n');
-        for (int i = 0; i < depth * indent; ++i)
-            add(' ');
+        size_t n = depth * indent;
+        for (; n > spaces.size(); n -= spaces.size())
+            sink->write(spaces);
+        sink->write(std::string_view{spaces}.substr(0, n));
     }
 }
 
@@ -784,12 +1112,12 @@ void DumpBuffer::dump_list(
         if (depth >= 0)
             ++depth;
         for (int i = 0; i < len; ++i) {
+            if (i != 0)
+                add(',');
             dump_pad();
             dump_value(source.get(i));
-            add(',');
         }
         depth = d;
-        pop();
         dump_pad();
     }
     add(']');
@@ -805,6 +1133,8 @@ void DumpBuffer::dump_map(
         if (depth >= 0)
             ++depth;
         for (int i = 0; i < len; ++i) {
+            if (i != 0)
+                add(',');
             dump_pad();
             MPair& mp = source.get_pair(i);
             dump_string(mp.first);
@@ -812,18 +1142,46 @@ void DumpBuffer::dump_map(
             if (depth >= 0)
                 add(' ');
             dump_value(mp.second);
-            add(',');
         }
         depth = d;
-        pop();
         dump_pad();
     }
     add('}');
 }
 
+// A macro's value which is used more than once is serialized only once
+// for each depth, the result then being copied.
+void DumpBuffer::dump_shared(
+    MValue& source)
+{
+    std::pair<const void*, int> key{source.minion_item(), depth};
+    auto it = fragments.find(key);
+    if (it == fragments.end()) {
+        StringSink fragment;
+        Sink* s = sink;
+        sink = &fragment;
+        try {
+            if (source.type == T_List)
+                dump_list(*source.m_list());
+            else
+                dump_map(*source.m_map());
+        } catch (...) {
+            sink = s;
+            throw;
+        }
+        sink = s;
+        it = fragments.emplace(key, fragment.view()).first;
+    }
+    sink->write(it->second);
+}
+
 void DumpBuffer::dump_value(
     MValue& source)
 {
+    if (source.shared && source.share_count() > 1) {
+        dump_shared(source);
+        return;
+    }
     switch (source.type) {
     case T_String:
         dump_string(*source.m_string());
@@ -839,8 +1197,8 @@ void DumpBuffer::dump_value(
     }
 }
 
-const char* DumpBuffer::dump(
-    MValue& data, int pretty)
+void DumpBuffer::set_pretty(
+    int pretty)
 {
     depth = -1;
     if (pretty >= 0) {
@@ -848,104 +1206,191 @@ const char* DumpBuffer::dump(
         if (pretty != 0)
             indent = pretty;
     }
+}
+
+const char* DumpBuffer::dump(
+    MValue& data, int pretty)
+{
+    set_pretty(pretty);
     buffer.clear();
-    dump_value(data);
+    sink = &buffer;
+    try {
+        dump_value(data);
+    } catch (...) {
+        fragments.clear();
+        throw;
+    }
+    fragments.clear();
     return buffer.c_str();
 }
 
+void DumpBuffer::dump(
+    MValue& data, Sink& out, int pretty)
+{
+    set_pretty(pretty);
+    sink = &out;
+    try {
+        dump_value(data);
+    } catch (...) {
+        sink = &buffer;
+        fragments.clear();
+        throw;
+    }
+    sink = &buffer;
+    fragments.clear();
+    out.flush();
+}
+
 // *** Special MValue "constructors" ***
 
-// Build a new minion string item from the given MString*.
+// Build a new minion string item, a long string being copied to the heap.
 MValue::MValue(
-    MString* m)
+    std::string_view s)
     : type{T_String}
-    , minion_item{m}
-{}
+{
+    string.set(s, false, nullptr);
+}
 
 // Build a new minion list item from the given MList*.
 MValue::MValue(
     MList* m)
-    : type{T_List}
-    , minion_item{m}
+    : MValue{T_List, m}
 {}
 
 // Build a new minion map item from the given MMap*.
 MValue::MValue(
     MMap* m)
-    : type{T_Map}
-    , minion_item{m}
+    : MValue{T_Map, m}
 {}
 
 MString* MValue::m_string()
 {
     if (type == T_String)
-        return reinterpret_cast<MString*>(minion_item);
+        return &string;
     return nullptr;
 }
 
 MList* MValue::m_list()
 {
     if (type == T_List)
-        return reinterpret_cast<MList*>(minion_item);
+        return reinterpret_cast<MList*>(minion_item());
     return nullptr;
 }
 
 MMap* MValue::m_map()
 {
     if (type == T_Map)
-        return reinterpret_cast<MMap*>(minion_item);
+        return reinterpret_cast<MMap*>(minion_item());
     return nullptr;
 }
 
-bool MList::get_string(
-    size_t index, std::string& s)
+// Set the contents: a short string is held in place, a long one refers to
+// `s` itself if `borrow` is set, otherwise to a copy, which is allocated
+// from `mr` if it is given, else on the heap (and then owned).
+void MString::set(
+    std::string_view s, bool borrow, std::pmr::memory_resource* mr)
 {
-    if (index < size()) {
-        MValue m = get(index);
-        if (MString* ms = m.m_string()) {
-            s = ms->data_view();
-            return true;
+    if (s.size() <= max_short) {
+        s.copy(bytes, s.size());
+        tag = uint8_t(s.size());
+        return;
+    }
+    const char* p = s.data();
+    size_t n = s.size();
+    tag = long_string;
+    if (!borrow) {
+        char* d;
+        if (mr)
+            d = static_cast<char*>(mr->allocate(n, 1));
+        else {
+            d = new char[n];
+            tag |= owned;
         }
-        std::string msg{"List: expecting string at index: "};
-        throw MinionError(msg.append(std::to_string(index)));
+        s.copy(d, n);
+        p = d;
     }
-    return false; // out of range
+    std::memcpy(bytes, &p, sizeof(p));
+    std::memcpy(bytes + sizeof(p), &n, sizeof(n));
 }
 
-bool MList::get_int(
-    size_t index, int& i)
+void MString::release()
 {
-    std::string s;
-    if (!get_string(index, s))
+    if (tag & owned)
+        delete[] data_view().data();
+    tag = 0;
+}
+
+MString* MList::string_at(
+    size_t index)
+{
+    if (MString* ms = get(index).m_string())
+        return ms;
+    std::string msg{"List: expecting string at index: "};
+    throw MinionError(msg.append(std::to_string(index)));
+}
+
+void MList::conversion_error(
+    conversion c, std::string_view s, const char* what, size_t index)
+{
+    throw MinionError(conversion_message(c, s, what)
+                          .append("List, seeking ")
+                          .append(what)
+                          .append(" value at index: ")
+                          .append(std::to_string(index)));
+}
+
+bool MList::get_string(
+    size_t index, std::string& s)
+{
+    if (index >= size())
         return false; // out of range
-    std::string msg{"List, seeking integer value at index: "};
-    i = string2int(s, msg.append(std::to_string(index)));
+    s = string_at(index)->data_view();
     return true;
 }
 
+bool MList::get_int(
+    size_t index, int& i)
+{
+    return get(index, i);
+}
+
+MString* MMap::string_at(
+    std::string_view key)
+{
+    // A reference to the value itself: a short string is held there
+    int i = search(key);
+    if (i < 0)
+        return nullptr;
+    if (MString* ms = data[i].second.m_string())
+        return ms;
+    std::string msg{"Map: value not string for key: "};
+    throw MinionError(msg.append(key));
+}
+
+void MMap::conversion_error(
+    conversion c, std::string_view s, const char* what, std::string_view key)
+{
+    throw MinionError(conversion_message(c, s, what)
+                          .append("Map, seeking ")
+                          .append(what)
+                          .append(" value at key: ")
+                          .append(key));
+}
+
 bool MMap::get_string(
     std::string_view key, std::string& s)
 {
-    MValue m = get(key);
-    if (m.is_null())
+    MString* ms = string_at(key);
+    if (!ms)
         return false;
-    if (MString* ms = m.m_string()) {
-        s = ms->data_view();
-        return true;
-    }
-    std::string msg{"Map: value not string for key: "};
-    throw MinionError(msg.append(key));
+    s = ms->data_view();
+    return true;
 }
 
 bool MMap::get_int(
     std::string_view key, int& i)
 {
-    std::string s;
-    if (!get_string(key, s))
-        return false;
-    std::string msg{"Map, seeking integer value at key: "};
-    i = string2int(s, msg.append(key));
-    return true;
+    return get(key, i);
 }
 
 } // End of namespace minion
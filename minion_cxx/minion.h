@@ -1,7 +1,17 @@
 #ifndef MINION_H
 #define MINION_H
 
+#include "convert.h"
+#include "filedata.h"
+#include "scanner.h"
+#include "sink.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory_resource>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 /* The parser, Minion::read returns a single minion_value. If there is an
@@ -26,14 +36,82 @@ struct position
 
 // forward declarations
 struct MValue;
-using MPair = std::pair<std::string, MValue>;
+using MPair = std::pair<std::pmr::string, MValue>;
 struct MinionValue;
+class Document;
+class MacroLibrary;
 class InputBuffer;
 class DumpBuffer;
 class MString;
 class MList;
 class MMap;
 
+// The copies of shared nodes made during a deep copy (source -> copy)
+using shared_copies = std::unordered_map<const void*, void*>;
+
+/* A string value. A short string (up to `max_short` bytes) is held in
+ * the `MValue` itself, so that most strings need no allocation of their
+ * own. A longer one refers to its data, which is allocated on the heap
+ * (and then owned by the string), in the arena of a `Document` or – in
+ * zero-copy mode – is part of the input. As the data of a short string
+ * moves with its `MValue`, a `data_view` is only valid as long as the
+ * `MValue` holding the string is unchanged.
+ */
+class MString
+{
+    friend MValue;
+    friend InputBuffer;
+
+    // Flags in `tag` for a long string
+    static constexpr uint8_t long_string = 0x80;
+    static constexpr uint8_t owned = 0x40;
+
+    // A short string, or the pointer to and size of a long one
+    char bytes[21]{};
+    uint8_t tag{0}; // the size of a short string, or the flags
+
+    MString() = default;
+
+    void set(std::string_view s, bool borrow, std::pmr::memory_resource* mr);
+    void release();
+
+public:
+    static constexpr size_t max_short = sizeof(bytes);
+
+    bool is_short() { return !(tag & long_string); }
+
+    std::string_view data_view()
+    {
+        if (tag & long_string) {
+            const char* p;
+            size_t n;
+            std::memcpy(&p, bytes, sizeof(p));
+            std::memcpy(&n, bytes + sizeof(p), sizeof(n));
+            return {p, n};
+        }
+        return {bytes, tag};
+    }
+
+#ifdef MINION_CONVERSION_CACHE
+    // This makes every MValue larger (not just strings)
+    conversion_cache cache;
+
+    template<typename T>
+    conversion to(
+        T& value)
+    {
+        return convert(data_view(), value, cache);
+    }
+#else
+    template<typename T>
+    conversion to(
+        T& value)
+    {
+        return convert(data_view(), value);
+    }
+#endif
+};
+
 struct MValue
 {
     friend MinionValue;
@@ -43,11 +121,14 @@ struct MValue
     friend DumpBuffer;
 
     MValue() = default;
-    MValue(MString* m);
+    MValue(std::string_view s); // a string with its own data
     MValue(MList* m);
     MValue(MMap* m);
 
     bool is_null() { return type == 0; }
+    // True for a use of a macro whose value is a list or a map. This value
+    // is shared by all uses of the macro, so it must not be modified.
+    bool is_shared() { return shared; }
 
     MString* m_string();
     MList* m_list();
@@ -58,29 +139,42 @@ struct MValue
 protected:
     void free();
 
-    int type{0};
-    bool not_owner{false};
-    void* minion_item{nullptr};
+    // The value of a string, otherwise the pointer to the list or map
+    // node is kept at the start of its bytes (see `minion_item`)
+    MString string;
+    uint8_t type{0};
+    bool shared{false};
+
+    void* minion_item()
+    {
+        void* p;
+        std::memcpy(&p, string.bytes, sizeof(p));
+        return p;
+    }
 
     MValue(
-        int t, void* p, bool o = false)
-        : type{t}
-        , not_owner{o}
-        , minion_item{p}
-    {}
+        int t, void* p, bool s = false)
+        : type{uint8_t(t)}
+        , shared{s}
+    {
+        std::memcpy(string.bytes, &p, sizeof(p));
+    }
 
-    void mcopy(MValue& m); // used by copy method
+    std::atomic<size_t>& share_count(); // only for shared values
+    void mcopy(MValue& m, shared_copies& copies); // used by copy method
 };
 
+#ifndef MINION_CONVERSION_CACHE
+static_assert(sizeof(MValue) == 24);
+#endif
+
 struct MinionValue : public MValue
 {
     MinionValue() = default;
     MinionValue(
         MValue m)
-    {
-        type = m.type;
-        minion_item = m.minion_item;
-    }
+        : MValue{m}
+    {}
 
     ~MinionValue() { free(); }
 
@@ -90,38 +184,101 @@ struct MinionValue : public MValue
         // self-assignment check
         if (this != &source) {
             this->free();
-            type = source.type;
-            minion_item = source.minion_item;
-            not_owner = false;
+            MValue::operator=(source);
         }
         return *this;
     }
 };
 
-class MString
+/* A memory resource handing out space from a list of large chunks. The
+ * space is only reclaimed as a whole, by `reset`, which keeps the chunks
+ * for reuse, or by `release`, which returns them to the heap.
+ */
+class Arena : public std::pmr::memory_resource
 {
-    std::string data;
+    std::vector<std::pair<char*, size_t>> chunks; // (start, size)
+    size_t current{0};      // index of the chunk in use
+    char* next{nullptr};    // free space in the current chunk ...
+    char* end{nullptr};     // ... ends here
+    size_t chunk_size;      // size of the next new chunk
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(
+        const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
 
 public:
-    MString() = default;
-
-    MString(
-        std::string_view s)
-        : data{s}
+    Arena(size_t initial_chunk_size = 1 << 16)
+        : chunk_size{initial_chunk_size}
     {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { release(); }
 
-    ~MString() = default;
+    void reset();
+    void release();
+    size_t n_chunks() { return chunks.size(); }
+};
 
-    std::string_view data_view() { return data; }
+/* A `Document` is an alternative to `MinionValue` for holding the result
+ * of a parse. All its nodes and their string data are allocated in its
+ * arena, so that it is freed (by `clear`, destruction or reading into it
+ * again) in time proportional to the number of arena chunks rather than
+ * the number of nodes. Reading into the same `Document` again reuses the
+ * chunks. Values may be copied out of a `Document` using `MValue::copy`,
+ * the copy being allocated normally.
+ * A `Document` read from a file (`minion::read_file`) keeps the file data
+ * until it is cleared or read into again, so that in zero-copy mode its
+ * strings can refer to the file.
+ */
+class Document
+{
+    friend InputBuffer;
+
+    Arena arena;
+    MValue root;
+    std::shared_ptr<FileData> source;
+
+    void reset()
+    {
+        root = {};
+        arena.reset();
+    }
+
+public:
+    Document() = default;
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    MValue& value() { return root; }
+    bool is_null() { return root.is_null(); }
+
+    void clear()
+    {
+        reset();
+        source.reset();
+    }
 };
 
 class MList
 {
-    std::vector<MValue> data;
+    std::pmr::vector<MValue> data;
+
+    MString* string_at(size_t index);
+    [[noreturn]] void conversion_error(
+        conversion c, std::string_view s, const char* what, size_t index);
 
 public:
     MList() = default;
 
+    MList(
+        std::pmr::memory_resource* mr)
+        : data{mr}
+    {}
+
     MList(
         std::initializer_list<MValue> items)
     {
@@ -133,11 +290,12 @@ public:
     MList(
         MList& source) // copy constructor
     {
+        shared_copies copies;
         data.reserve(source.data.size());
         for (auto& mv : source.data) {   // mv is reference to source element
             data.emplace_back(MValue{}); // add null MValue
             MValue& mref = data.back();  // get reference to added MValue
-            mv.mcopy(mref);
+            mv.mcopy(mref, copies);
         }
     }
 
@@ -164,15 +322,82 @@ public:
 
     bool get_string(size_t index, std::string& s);
     bool get_int(size_t index, int& i);
+
+    // Get a value converted to an integer, floating-point, boolean or
+    // `std::chrono::duration` type (see convert.h). Return false if the
+    // index is out of range, throw a `MinionError` if the value is not a
+    // string or can't be converted.
+    template<typename T>
+    bool get(
+        size_t index, T& value)
+    {
+        if (index >= size())
+            return false;
+        MString* ms = string_at(index);
+        if (conversion c = ms->to(value); c != conversion::ok)
+            conversion_error(c, ms->data_view(), conversion_name<T>(), index);
+        return true;
+    }
+};
+
+/* Hash index for the keys of a map. A map retains its input order by
+ * holding its entries in a vector of key/value pairs, which is searched
+ * linearly while it is small. Once a map has more than `threshold`
+ * entries, an open-addressing hash table of the positions of its pairs
+ * is kept, which is extended as pairs are added (`sync`). A search thus
+ * only reads the map, so that a map which is no longer changed can be
+ * searched by several threads at once. Keys must not be changed in place.
+ * If a key occurs more than once, the first entry is found.
+ */
+class MapIndex
+{
+    struct slot
+    {
+        uint32_t hash;
+        uint32_t pos; // 1 + index of the pair, 0 for an empty slot
+    };
+    std::pmr::vector<slot> slots;
+    size_t n_indexed{0};
+
+public:
+    static constexpr size_t threshold = 16;
+
+    MapIndex() = default;
+    MapIndex(
+        std::pmr::memory_resource* mr)
+        : slots{mr}
+    {}
+
+    // Index the pairs added since the last call
+    void sync(const std::pmr::vector<MPair>& pairs);
+    // Return the index of the pair with the given key, or -1 if there
+    // is none.
+    int find(const std::pmr::vector<MPair>& pairs, std::string_view key) const;
+    void clear()
+    {
+        slots.clear();
+        n_indexed = 0;
+    }
 };
 
 class MMap
 {
-    std::vector<MPair> data;
+    std::pmr::vector<MPair> data;
+    MapIndex index;
+
+    MString* string_at(std::string_view key);
+    [[noreturn]] void conversion_error(
+        conversion c, std::string_view s, const char* what, std::string_view key);
 
 public:
     MMap() = default;
 
+    MMap(
+        std::pmr::memory_resource* mr)
+        : data{mr}
+        , index{mr}
+    {}
+
     MMap(
         std::initializer_list<MPair> items)
     {
@@ -184,13 +409,16 @@ public:
     MMap(
         MMap& source) // copy constructor
     {
+        shared_copies copies;
         data.reserve(source.data.size());
         for (auto& mp : source.data) { // mv is reference to source element
             // add pair with null MValue
             data.emplace_back(MPair{mp.first, {}});
             MValue& mref = data.back().second; // get reference to added MValue
-            mp.second.mcopy(mref);
+            mp.second.mcopy(mref, copies);
         }
+        if (size() > MapIndex::threshold)
+            index.sync(data);
     }
 
     ~MMap() { clear(); }
@@ -201,6 +429,24 @@ public:
             m.second.free();
         }
         data.clear();
+        index.clear();
+    }
+
+    // Remove all entries without freeing their values (which must be
+    // owned elsewhere, e.g. by an `Arena`).
+    void reset()
+    {
+        data.clear();
+        index.clear();
+    }
+
+    // Exchange the contents with those of another map, with their index.
+    // Both must use the same memory resource.
+    void swap(
+        MMap& other)
+    {
+        data.swap(other.data);
+        std::swap(index, other.index);
     }
 
     size_t size() { return data.size(); }
@@ -209,6 +455,16 @@ public:
         MPair m)
     {
         data.emplace_back(m);
+        if (size() > MapIndex::threshold)
+            index.sync(data);
+    }
+
+    void add(
+        std::string_view key, MValue m)
+    {
+        data.emplace_back(key, m);
+        if (size() > MapIndex::threshold)
+            index.sync(data);
     }
 
     MPair& get_pair(
@@ -218,41 +474,106 @@ public:
     }
 
     int search(
-        std::string_view key)
+        std::string_view key) const
     {
-        int i = 0;
-        for (auto& mp : data) {
-            if (mp.first == key)
-                return i;
-            ++i;
-        }
-        return -1;
+        return index.find(data, key);
     }
 
     MValue get(
         std::string_view key)
     {
-        for (auto& mp : data) {
-            if (mp.first == key)
-                return mp.second;
-        }
-        return {};
+        int i = search(key);
+        if (i < 0)
+            return {};
+        return data[i].second;
     }
 
     bool get_string(std::string_view key, std::string& s);
     bool get_int(std::string_view key, int& i);
+
+    // Get a value converted to an integer, floating-point, boolean or
+    // `std::chrono::duration` type (see convert.h). Return false if the
+    // key is not present, throw a `MinionError` if the value is not a
+    // string or can't be converted.
+    template<typename T>
+    bool get(
+        std::string_view key, T& value)
+    {
+        MString* ms = string_at(key);
+        if (!ms)
+            return false;
+        if (conversion c = ms->to(value); c != conversion::ok)
+            conversion_error(c, ms->data_view(), conversion_name<T>(), key);
+        return true;
+    }
+};
+
+/* A set of macros read from a document which contains only macro
+ * definitions (`InputBuffer::read(MacroLibrary&, ...)`), e.g. a preamble
+ * shared by many documents. Documents read with the library can use its
+ * macros without reading them again. Values which are lists or maps are
+ * shared with these documents (see `MValue::is_shared`), so they are only
+ * freed when the library and all the documents using them have been
+ * freed; strings are copied. However, a
+ * `Document` refers to the library's values without holding them, so
+ * the library must remain as long as such a document is in use.
+ * Reading with the library doesn't modify it (apart from the atomic
+ * reference counts), so documents may be read and used with it on
+ * several threads at once – unless, in a build with
+ * MINION_CONVERSION_CACHE, its values are read by the typed `get` methods
+ * (see convert.h).
+ */
+class MacroLibrary
+{
+    friend InputBuffer;
+
+    MMap macros;
+
+public:
+    MacroLibrary() = default;
+    MacroLibrary(const MacroLibrary&) = delete;
+    MacroLibrary& operator=(const MacroLibrary&) = delete;
+
+    size_t size() { return macros.size(); }
+    // The value of a macro (the name includes the initial '&'), empty if
+    // there is no such macro
+    MValue get(std::string_view name) { return macros.get(name); }
 };
 
 class InputBuffer
 {
     MMap macro_map;
     MValue get_macro(std::string_view s);
+    MValue macro_value(MValue& mp, bool count);
+    void clear_macros();
+
+    // Macros defined before the input, if set
+    MacroLibrary* library{nullptr};
+    // Set when reading a macro library
+    MacroLibrary* new_library{nullptr};
+
+    // New nodes are allocated here if it is set, otherwise on the heap
+    Arena* arena{nullptr};
+
+    template<typename T, typename... Args>
+    T* new_node(
+        Args&&... args)
+    {
+        if (arena)
+            return new (arena->allocate(sizeof(T), alignof(T)))
+                T(std::forward<Args>(args)..., arena);
+        return new T(std::forward<Args>(args)...);
+    }
 
     std::string_view input;
+    Scanner scanner;
     size_t ch_index;
     size_t line_index;
     size_t ch_linestart;
-    std::string ch_buffer; // for reading strings
+    std::string ch_buffer;       // for decoding strings with escapes
+    std::string_view string_item; // the string most recently read
+    bool string_in_input;        // `string_item` refers to the input
+    bool zero_copy{false};
 
     std::string error_message;
 
@@ -265,28 +586,58 @@ class InputBuffer
         return std::to_string(p.line_n) + '.' + std::to_string(p.byte_ix);
     }
     void error(std::string_view msg);
+    void library_value_error();
     void get_item(MValue& mvalue, int expect = 0);
     void get_string(char ch);
     void get_bare_string(char ch);
     bool add_unicode_to_ch_buffer(int len);
+    MValue new_string();
+    const char* parse(MValue& data, std::string_view s);
 
 public:
+    // In zero-copy mode, strings which contain no escapes (or embedded
+    // comments) are not copied, but refer directly to the input, which
+    // must then remain valid as long as the result is in use.
+    void set_zero_copy(
+        bool on)
+    {
+        zero_copy = on;
+    }
+
     const char* read(MinionValue& data, std::string_view s);
+    const char* read(Document& doc, std::string_view s);
+    const char* read(Document& doc, std::shared_ptr<FileData> file);
+
+    // Read a document containing only macro definitions into a library,
+    // replacing its previous contents (zero-copy mode is not used).
+    const char* read(MacroLibrary& lib, std::string_view s);
+    // Read a document which may use the macros of the library, as well as
+    // its own (which may have the same names, and then take precedence)
+    const char* read(MinionValue& data, std::string_view s, MacroLibrary& lib);
+    const char* read(Document& doc, std::string_view s, MacroLibrary& lib);
 };
 
+/* The serializer. By default the output is collected in a string (which
+ * is reused by the next `dump`), but it can also be passed to another
+ * `Sink` (e.g. a file) as it is produced.
+ */
 class DumpBuffer
 {
     int indent = 2;
     int depth;
-    std::string buffer;
+    StringSink buffer; // the default sink
+    Sink* sink{&buffer};
+    // The serialized values of macros, by (node, depth)
+    std::map<std::pair<const void*, int>, std::string> fragments;
 
     void add(
         char ch)
     {
-        buffer.push_back(ch);
+        sink->put(ch);
     }
-    void pop() { buffer.pop_back(); }
+    void set_pretty(int pretty);
     void dump_value(MValue& source);
+    void dump_shared(MValue& source);
     void dump_string(std::string_view source);
     void dump_string(MString& source);
     void dump_list(MList& source);
@@ -294,7 +645,13 @@ class DumpBuffer
     void dump_pad();
 
 public:
+    DumpBuffer() = default;
+    DumpBuffer(const DumpBuffer&) = delete;
+    DumpBuffer& operator=(const DumpBuffer&) = delete;
+
     const char* dump(MValue& data, int pretty = -1);
+    // Write to the given sink, which is flushed at the end
+    void dump(MValue& data, Sink& out, int pretty = -1);
 };
 
 } // namespace minion
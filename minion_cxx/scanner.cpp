@@ -0,0 +1,295 @@
+#include "scanner.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MINION_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace minion {
+
+// Class bits for each byte value, used by the scalar classifier
+struct class_table
+{
+    unsigned char bits[256];
+
+    constexpr class_table()
+        : bits{}
+    {
+        for (int i = 0; i < 32; ++i)
+            bits[i] = C_Control;
+        bits[127] = C_Control;
+        bits[(unsigned char) ' '] = C_Space;
+        bits[(unsigned char) '\t'] |= C_Space;
+        bits[(unsigned char) '\r'] |= C_Space;
+        bits[(unsigned char) '\n'] |= C_Space | C_Newline;
+        bits[(unsigned char) '"'] = C_Quote;
+        bits[(unsigned char) '\\'] = C_Quote;
+        for (unsigned char ch : {'{', '}', '[', ']', ':', ',', '#', '&'})
+            bits[ch] = C_Structural;
+    }
+};
+
+constexpr class_table char_classes;
+
+void classify_scalar(
+    const char* p, block_masks& m)
+{
+    m = {};
+    for (int i = 0; i < 64; ++i) {
+        unsigned c = char_classes.bits[(unsigned char) p[i]];
+        uint64_t bit = uint64_t{1} << i;
+        if (c & C_Space)
+            m.space |= bit;
+        if (c & C_Newline)
+            m.newline |= bit;
+        if (c & C_Control)
+            m.control |= bit;
+        if (c & C_Quote)
+            m.quote |= bit;
+        if (c & C_Structural)
+            m.structural |= bit;
+    }
+}
+
+#ifdef MINION_X86_SIMD
+
+__attribute__((target("sse4.2"))) void classify_sse42(
+    const char* p, block_masks& m)
+{
+    m = {};
+    const __m128i c1f = _mm_set1_epi8(0x1F);
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        // '[' and ']' differ from '{' and '}' only in bit 0x20
+        __m128i v20 = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+        __m128i sp = _mm_or_si128(_mm_or_si128(nl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                                               _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        __m128i ct = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, c1f), v),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8(127)));
+        __m128i qt = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        __m128i st = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v20, _mm_set1_epi8('{')),
+                         _mm_cmpeq_epi8(v20, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('&')))));
+        m.space |= uint64_t(uint16_t(_mm_movemask_epi8(sp))) << i;
+        m.newline |= uint64_t(uint16_t(_mm_movemask_epi8(nl))) << i;
+        m.control |= uint64_t(uint16_t(_mm_movemask_epi8(ct))) << i;
+        m.quote |= uint64_t(uint16_t(_mm_movemask_epi8(qt))) << i;
+        m.structural |= uint64_t(uint16_t(_mm_movemask_epi8(st))) << i;
+    }
+}
+
+__attribute__((target("avx2"))) void classify_avx2(
+    const char* p, block_masks& m)
+{
+    m = {};
+    const __m256i c1f = _mm256_set1_epi8(0x1F);
+    for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i v20 = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+        __m256i sp = _mm256_or_si256(
+            _mm256_or_si256(nl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        __m256i ct = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, c1f), v),
+                                     _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127)));
+        __m256i qt = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        __m256i st = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v20, _mm256_set1_epi8('{')),
+                            _mm256_cmpeq_epi8(v20, _mm256_set1_epi8('}'))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')))));
+        m.space |= uint64_t(uint32_t(_mm256_movemask_epi8(sp))) << i;
+        m.newline |= uint64_t(uint32_t(_mm256_movemask_epi8(nl))) << i;
+        m.control |= uint64_t(uint32_t(_mm256_movemask_epi8(ct))) << i;
+        m.quote |= uint64_t(uint32_t(_mm256_movemask_epi8(qt))) << i;
+        m.structural |= uint64_t(uint32_t(_mm256_movemask_epi8(st))) << i;
+    }
+}
+
+#endif // MINION_X86_SIMD
+
+using classifier = void (*)(const char*, block_masks&);
+
+// Choose the best classifier for the processor, once only.
+classifier get_classifier()
+{
+    static const classifier c = []() -> classifier {
+#ifdef MINION_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return classify_avx2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return classify_sse42;
+#endif
+        return classify_scalar;
+    }();
+    return c;
+}
+
+size_t find_escape_scalar(
+    const char* p, size_t from, size_t n)
+{
+    for (; from < n; ++from) {
+        if (char_classes.bits[(unsigned char) p[from]] & (C_Quote | C_Control))
+            break;
+    }
+    return from;
+}
+
+#ifdef MINION_X86_SIMD
+
+__attribute__((target("sse4.2"))) size_t find_escape_sse42(
+    const char* p, size_t from, size_t n)
+{
+    const __m128i c1f = _mm_set1_epi8(0x1F);
+    for (; from + 16 <= n; from += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + from));
+        __m128i e = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, c1f), v),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(127))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+        unsigned m = uint16_t(_mm_movemask_epi8(e));
+        if (m)
+            return from + std::countr_zero(m);
+    }
+    return find_escape_scalar(p, from, n);
+}
+
+__attribute__((target("avx2"))) size_t find_escape_avx2(
+    const char* p, size_t from, size_t n)
+{
+    const __m256i c1f = _mm256_set1_epi8(0x1F);
+    for (; from + 32 <= n; from += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + from));
+        __m256i e = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, c1f), v),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+        unsigned m = _mm256_movemask_epi8(e);
+        if (m)
+            return from + std::countr_zero(m);
+    }
+    return find_escape_sse42(p, from, n);
+}
+
+#endif // MINION_X86_SIMD
+
+using escape_finder = size_t (*)(const char*, size_t, size_t);
+
+escape_finder get_escape_finder()
+{
+    static const escape_finder f = []() -> escape_finder {
+#ifdef MINION_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return find_escape_avx2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return find_escape_sse42;
+#endif
+        return find_escape_scalar;
+    }();
+    return f;
+}
+
+size_t find_escape(
+    std::string_view s, size_t from)
+{
+    if (s.size() - from < 16) // too short for the vector instructions
+        return find_escape_scalar(s.data(), from, s.size());
+    return get_escape_finder()(s.data(), from, s.size());
+}
+
+void Scanner::reset(
+    std::string_view s)
+{
+    input = s;
+    block_start = SIZE_MAX;
+}
+
+void Scanner::classify(
+    size_t start)
+{
+    block_start = start;
+    if (input.size() - start >= 64) {
+        get_classifier()(input.data() + start, masks);
+    } else {
+        // The final, partial block is padded with 0 bytes. These count as
+        // control characters and so stop any scan at the end of the input.
+        char tail[64] = {};
+        std::memcpy(tail, input.data() + start, input.size() - start);
+        get_classifier()(tail, masks);
+    }
+}
+
+uint64_t Scanner::select(
+    unsigned classes)
+{
+    uint64_t m = 0;
+    if (classes & C_Space)
+        m |= masks.space;
+    if (classes & C_Newline)
+        m |= masks.newline;
+    if (classes & C_Control)
+        m |= masks.control;
+    if (classes & C_Quote)
+        m |= masks.quote;
+    if (classes & C_Structural)
+        m |= masks.structural;
+    return m;
+}
+
+size_t Scanner::find(
+    size_t from, unsigned classes)
+{
+    while (from < input.size()) {
+        size_t start = from & ~size_t{63};
+        if (start != block_start)
+            classify(start);
+        uint64_t m = select(classes) >> (from - start);
+        if (m)
+            return std::min(from + std::countr_zero(m), input.size());
+        from = start + 64;
+    }
+    return input.size();
+}
+
+size_t Scanner::skip_space(
+    size_t from, size_t& line_index, size_t& line_start)
+{
+    while (from < input.size()) {
+        size_t start = from & ~size_t{63};
+        if (start != block_start)
+            classify(start);
+        size_t shift = from - start;
+        uint64_t stop = ~masks.space >> shift;
+        uint64_t nl = masks.newline >> shift;
+        if (stop)
+            nl &= (stop & -stop) - 1; // only the newlines before the stop
+        if (nl) {
+            line_index += std::popcount(nl);
+            line_start = from + (64 - std::countl_zero(nl));
+        }
+        if (stop)
+            return std::min(from + std::countr_zero(stop), input.size());
+        from = start + 64;
+    }
+    return input.size();
+}
+
+} // namespace minion
@@ -0,0 +1,70 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/* The structural scanner is the first stage of the tokenizer. It
+ * classifies the input in blocks of 64 bytes, producing a bitmask for
+ * each class of "interesting" character, so that the token reader can
+ * skip over whole runs of ordinary characters (and whitespace) instead
+ * of examining them one at a time.
+ *
+ * The classification uses AVX2 or SSE4.2 instructions if the processor
+ * supports them (this is checked at run time), otherwise a table-driven
+ * scalar loop.
+ */
+
+namespace minion {
+
+// Character classes, these may be combined to select the stopping
+// characters for a scan.
+enum scan_class : unsigned {
+    C_Space = 1,      // ' ', '\t', '\r', '\n'
+    C_Newline = 2,    // '\n'
+    C_Control = 4,    // 0 – 31 (including '\t', '\r', '\n') and 127
+    C_Quote = 8,      // '"', '\\'
+    C_Structural = 16 // '{', '}', '[', ']', ':', ',', '#', '&'
+};
+
+// One bit per byte of a 64-byte block, for each character class
+struct block_masks
+{
+    uint64_t space;
+    uint64_t newline;
+    uint64_t control;
+    uint64_t quote;
+    uint64_t structural;
+};
+
+class Scanner
+{
+    std::string_view input;
+    size_t block_start; // input index of the classified block
+    block_masks masks;
+
+    void classify(size_t start);
+    uint64_t select(unsigned classes);
+
+public:
+    void reset(std::string_view s);
+
+    // Return the index of the first byte at or after `from` which is in
+    // one of the given classes, or the size of the input if there is none.
+    size_t find(size_t from, unsigned classes);
+
+    // Return the index of the first byte at or after `from` which is not
+    // whitespace. Newlines passed over are counted in `line_index` and
+    // `line_start` is set to the index following the last of these.
+    size_t skip_space(size_t from, size_t& line_index, size_t& line_start);
+};
+
+// Return the index of the first byte at or after `from` which must be
+// escaped in a serialized string ('"', '\\', control characters), or
+// the size of `s` if there is none.
+size_t find_escape(std::string_view s, size_t from = 0);
+
+} // namespace minion
+
+#endif // SCANNER_H
@@ -0,0 +1,120 @@
+#include "sink.h"
+#include <algorithm>
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace minion {
+
+void Sink::write_long(
+    std::string_view s)
+{
+    while (true) {
+        size_t room = end - next;
+        if (s.size() <= room)
+            break;
+        std::memcpy(next, s.data(), room);
+        next += room;
+        s.remove_prefix(room);
+        overflow(s.size());
+    }
+    std::memcpy(next, s.data(), s.size());
+    next += s.size();
+}
+
+void StringSink::overflow(
+    size_t n)
+{
+    size_t used = next - data.data();
+    data.resize(std::max({used + n, data.size() * 2, size_t(256)}));
+    next = data.data() + used;
+    end = data.data() + data.size();
+}
+
+const char* StringSink::c_str()
+{
+    put(0);
+    --next;
+    return data.data();
+}
+
+ChunkedSink::ChunkedSink(
+    size_t chunk_size)
+    : buffer{new char[chunk_size]}
+    , size{chunk_size}
+{
+    next = buffer.get();
+    end = next + size;
+}
+
+void ChunkedSink::overflow(
+    size_t)
+{
+    flush();
+}
+
+void ChunkedSink::flush()
+{
+    if (next != buffer.get() && !failed)
+        failed = !output(buffer.get(), next - buffer.get());
+    discard();
+}
+
+bool FileSink::output(
+    const char* p, size_t n)
+{
+    return fwrite(p, 1, n, file) == n;
+}
+
+void FileSink::flush()
+{
+    ChunkedSink::flush();
+    if (fflush(file) != 0)
+        failed = true;
+}
+
+bool FdSink::output(
+    const char* p, size_t n)
+{
+    while (n != 0) {
+        ssize_t k = ::write(fd, p, n);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+void FdSink::write_long(
+    std::string_view s)
+{
+    std::string_view b = pending();
+    discard();
+    if (failed)
+        return;
+    iovec iov[2] = {{const_cast<char*>(b.data()), b.size()},
+                    {const_cast<char*>(s.data()), s.size()}};
+    int i = 0;
+    while (i < 2) {
+        ssize_t k = writev(fd, iov + i, 2 - i);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            failed = true;
+            return;
+        }
+        // Skip the parts which have been written
+        for (; i < 2 && size_t(k) >= iov[i].iov_len; ++i)
+            k -= iov[i].iov_len;
+        if (i < 2) {
+            iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + k;
+            iov[i].iov_len -= k;
+        }
+    }
+}
+
+} // namespace minion
@@ -0,0 +1,152 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/* Output destinations for the serializer. A sink has a buffer, into
+ * which single characters and runs of characters are copied. When it is
+ * full, `overflow` is called to make room – by growing the buffer (for a
+ * string) or by passing its contents on (for a file, etc.).
+ */
+
+namespace minion {
+
+class Sink
+{
+protected:
+    char* next{nullptr}; // next free byte in the buffer
+    char* end{nullptr};  // end of the buffer
+
+    // Make room for at least one more byte, preferably for `n`.
+    virtual void overflow(size_t n) = 0;
+    // Write a run which doesn't fit in the buffer.
+    virtual void write_long(std::string_view s);
+
+public:
+    Sink() = default;
+    Sink(const Sink&) = delete;
+    Sink& operator=(const Sink&) = delete;
+    virtual ~Sink() = default;
+
+    void put(
+        char ch)
+    {
+        if (next == end)
+            overflow(1);
+        *next++ = ch;
+    }
+
+    void write(
+        std::string_view s)
+    {
+        if (s.size() > size_t(end - next)) {
+            write_long(s);
+            return;
+        }
+        std::memcpy(next, s.data(), s.size());
+        next += s.size();
+    }
+
+    // Pass any buffered output on to the destination.
+    virtual void flush() {}
+};
+
+// Collect the output in a string
+class StringSink : public Sink
+{
+    std::string data;
+
+    void overflow(size_t n) override;
+
+public:
+    StringSink() { next = end = data.data(); }
+
+    std::string_view view() { return {data.data(), size_t(next - data.data())}; }
+    // The output, 0-terminated
+    const char* c_str();
+    void clear() { next = data.data(); }
+};
+
+// Output in chunks of a fixed size (the buffer size), which are passed
+// on by a virtual function, `output`.
+class ChunkedSink : public Sink
+{
+    std::unique_ptr<char[]> buffer;
+    size_t size;
+
+protected:
+    bool failed{false};
+
+    void overflow(size_t n) override;
+    // Pass on a chunk (or a long run), return false if this fails.
+    virtual bool output(const char* p, size_t n) = 0;
+
+    std::string_view pending() { return {buffer.get(), size_t(next - buffer.get())}; }
+    void discard() { next = buffer.get(); }
+
+public:
+    static constexpr size_t default_size = 64 * 1024;
+
+    ChunkedSink(size_t chunk_size = default_size);
+
+    void flush() override;
+    // True if all the output so far has been passed on successfully
+    bool ok() { return !failed; }
+};
+
+// Pass the chunks to a callback function
+class CallbackSink : public ChunkedSink
+{
+    std::function<bool(std::string_view)> callback;
+
+    bool output(const char* p, size_t n) override { return callback({p, n}); }
+
+public:
+    CallbackSink(
+        std::function<bool(std::string_view)> f, size_t chunk_size = default_size)
+        : ChunkedSink(chunk_size)
+        , callback{std::move(f)}
+    {}
+};
+
+// Write to a stdio stream
+class FileSink : public ChunkedSink
+{
+    FILE* file;
+
+    bool output(const char* p, size_t n) override;
+
+public:
+    FileSink(
+        FILE* f, size_t chunk_size = default_size)
+        : ChunkedSink(chunk_size)
+        , file{f}
+    {}
+    void flush() override;
+};
+
+// Write to a file descriptor. A long run is written together with the
+// buffered output by `writev`, without being copied to the buffer.
+class FdSink : public ChunkedSink
+{
+    int fd;
+
+    bool output(const char* p, size_t n) override;
+    void write_long(std::string_view s) override;
+
+public:
+    FdSink(
+        int f, size_t chunk_size = default_size)
+        : ChunkedSink(chunk_size)
+        , fd{f}
+    {}
+};
+
+} // namespace minion
+
+#endif // SINK_H
@@ -0,0 +1,280 @@
+#include "binary.h"
+#include <algorithm>
+
+namespace minion {
+
+void BinaryWriter::u32(
+    size_t n)
+{
+    if (n > 0xFFFFFFFF)
+        throw MinionError("BinaryWriter: item too large for binary form");
+    for (int i = 0; i < 4; ++i) {
+        sink.put(char(n & 0xFF));
+        n >>= 8;
+    }
+}
+
+void BinaryWriter::bytes(
+    std::string_view s)
+{
+    u32(s.size());
+    sink.write(s);
+}
+
+void BinaryWriter::start()
+{
+    if (written)
+        throw MinionError("BinaryWriter: only one document can be written");
+    written = true;
+    sink.write({magic, 4});
+    sink.put(char(version & 0xFF));
+    sink.put(char(version >> 8));
+    sink.put(0); // flags
+    sink.put(0);
+}
+
+void BinaryWriter::write_value(
+    MValue& m)
+{
+    if (auto ms = m.m_string()) {
+        sink.put(T_String);
+        bytes(**ms);
+    } else if (auto ml = m.m_list()) {
+        sink.put(T_List);
+        u32((*ml)->size());
+        for (auto& v : **ml)
+            write_value(v);
+    } else if (auto mm = m.m_map()) {
+        sink.put(T_Map);
+        u32((*mm)->size());
+        for (size_t i = 0; i < (*mm)->size(); ++i) {
+            MPair& mp = (*mm)->get_pair(i);
+            bytes(mp.first);
+            write_value(mp.second);
+        }
+    } else
+        throw MinionError("BinaryWriter: value is not a string, list or map");
+}
+
+void BinaryWriter::write_node(
+    Node n)
+{
+    switch (n.type()) {
+    case T_String:
+        sink.put(T_String);
+        bytes(n.str());
+        break;
+    case T_List:
+        sink.put(T_List);
+        u32(n.size());
+        for (auto it = n.begin(); it != n.end(); ++it)
+            write_node(*it);
+        break;
+    case T_Map:
+        sink.put(T_Map);
+        u32(n.size());
+        for (auto it = n.begin(); it != n.end(); ++it) {
+            bytes(it.key());
+            write_node(*it);
+        }
+        break;
+    default:
+        throw MinionError("BinaryWriter: node is not a string, list or map");
+    }
+}
+
+void BinaryWriter::write(
+    MValue& m)
+{
+    start();
+    write_value(m);
+    sink.flush();
+}
+
+void BinaryWriter::write(
+    Node n)
+{
+    start();
+    write_node(n);
+    sink.flush();
+}
+
+//static
+std::string BinaryWriter::dump(
+    MValue& m)
+{
+    StringSink out;
+    BinaryWriter(out).write(m);
+    return std::string{out.view()};
+}
+
+//static
+bool BinaryWriter::is_binary(
+    std::string_view s)
+{
+    return s.size() >= header_size && s.substr(0, 4) == std::string_view{magic, 4};
+}
+
+/* Decode the binary form, passing the items to a handler in the same
+ * way as the text reader. The input is checked as it is read, so that
+ * damaged data gives an error rather than undefined behaviour.
+ */
+class BinaryReader
+{
+    std::string_view input;
+    size_t pos{0};
+    Handler* handler; // if null, an `MValue` tree is built
+
+    [[noreturn]] void error(
+        std::string_view msg)
+    {
+        throw MinionError(std::string{"Binary data: "}
+                              .append(msg)
+                              .append(" at offset ")
+                              .append(std::to_string(pos)));
+    }
+
+    void need(
+        size_t n)
+    {
+        if (input.size() - pos < n)
+            error("unexpected end of data");
+    }
+
+    uint32_t u32()
+    {
+        need(4);
+        auto p = reinterpret_cast<const unsigned char*>(input.data() + pos);
+        pos += 4;
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16
+               | uint32_t(p[3]) << 24;
+    }
+
+    std::string_view bytes()
+    {
+        size_t n = u32();
+        need(n);
+        auto s = input.substr(pos, n);
+        pos += n;
+        return s;
+    }
+
+    void value()
+    {
+        need(1);
+        int tag = (unsigned char) input[pos++];
+        switch (tag) {
+        case T_String:
+            handler->on_string(bytes());
+            break;
+        case T_List: {
+            handler->on_list_begin();
+            for (uint32_t n = u32(); n != 0; --n)
+                value();
+            handler->on_list_end();
+            break;
+        }
+        case T_Map: {
+            handler->on_map_begin();
+            for (uint32_t n = u32(); n != 0; --n) {
+                handler->on_key(bytes());
+                value();
+            }
+            handler->on_map_end();
+            break;
+        }
+        default:
+            --pos;
+            error(std::string{"invalid item type "}.append(std::to_string(tag)));
+        }
+    }
+
+    // Build the tree directly, which is faster than using a `TreeBuilder`
+    // as the sizes of the lists and maps are known in advance
+    MValue tree()
+    {
+        need(1);
+        int tag = (unsigned char) input[pos++];
+        switch (tag) {
+        case T_String:
+            return bytes();
+        case T_List: {
+            MList empty;
+            MValue m = empty;
+            MList& l = **m.m_list();
+            uint32_t n = u32();
+            // Don't trust the count further than the data
+            l.reserve(std::min<size_t>(n, input.size() - pos));
+            for (; n != 0; --n)
+                l.emplace_back(tree());
+            return m;
+        }
+        case T_Map: {
+            MMap empty;
+            MValue m = empty;
+            MMap& mm = **m.m_map();
+            uint32_t n = u32();
+            mm.reserve(std::min<size_t>(n, input.size() - pos));
+            for (; n != 0; --n) {
+                std::string key{bytes()};
+                mm.emplace_back(std::move(key), tree());
+            }
+            return m;
+        }
+        default:
+            --pos;
+            error(std::string{"invalid item type "}.append(std::to_string(tag)));
+        }
+    }
+
+public:
+    BinaryReader(
+        std::string_view s, Handler* h = nullptr)
+        : input{s}
+        , handler{h}
+    {}
+
+    MValue read()
+    {
+        if (!BinaryWriter::is_binary(input))
+            error("not in MINION binary form");
+        auto p = reinterpret_cast<const unsigned char*>(input.data());
+        unsigned v = p[4] | p[5] << 8;
+        if (v != BinaryWriter::version)
+            error(std::string{"unsupported version "}.append(std::to_string(v)));
+        pos = BinaryWriter::header_size;
+        MValue m;
+        if (handler)
+            value();
+        else
+            m = tree();
+        if (pos != input.size())
+            error("unexpected data after the document");
+        return m;
+    }
+};
+
+//static
+MValue Reader::read_binary(
+    std::string_view s)
+{
+    try {
+        return BinaryReader(s).read();
+    } catch (MinionError& e) {
+        return e;
+    }
+}
+
+//static
+MValue Reader::read_binary(
+    std::string_view s, Handler& h)
+{
+    try {
+        BinaryReader(s, &h).read();
+    } catch (MinionError& e) {
+        return e;
+    }
+    return {};
+}
+
+} // namespace minion
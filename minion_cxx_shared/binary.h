@@ -0,0 +1,62 @@
+#ifndef BINARY_H
+#define BINARY_H
+
+#include "minion.h"
+#include "tape.h"
+
+/* A binary form of a parsed document, which can be loaded again without
+ * tokenizing or decoding escapes. It starts with an 8-byte header: the
+ * magic bytes "MINB", then the format version and a flags field (both
+ * 16-bit, currently 1 and 0). This is followed by the top-level item:
+ *
+ *     string:  0x01, length (u32), bytes
+ *     list:    0x02, number of elements (u32), elements
+ *     map:     0x03, number of entries (u32), entries, each a key
+ *              (length (u32), bytes) followed by its value
+ *
+ * All numbers are little-endian. The binary form contains no macros: a
+ * macro's value is written in full wherever it is used.
+ * The data is read from a `std::string_view`, so a file can be mapped
+ * into memory (`read_file`) and passed to `Reader::read_binary` directly,
+ * without copying.
+ */
+
+namespace minion {
+
+class BinaryWriter
+{
+    Sink& sink;
+    bool written{false};
+
+    void u32(size_t n);
+    void bytes(std::string_view s);
+    void start();
+    void write_value(MValue& m);
+    void write_node(Node n);
+
+public:
+    static constexpr char magic[4] = {'M', 'I', 'N', 'B'};
+    static constexpr uint16_t version = 1;
+    static constexpr size_t header_size = 8;
+
+    BinaryWriter(
+        Sink& out)
+        : sink{out}
+    {}
+    BinaryWriter(const BinaryWriter&) = delete;
+    BinaryWriter& operator=(const BinaryWriter&) = delete;
+
+    // Write the document (only one per writer) and flush the sink
+    void write(MValue& m);
+    void write(Node n);
+
+    // The binary form as a string
+    static std::string dump(MValue& m);
+
+    // True if the data starts with the binary header (of any version)
+    static bool is_binary(std::string_view s);
+};
+
+} // namespace minion
+
+#endif // BINARY_H
@@ -0,0 +1,211 @@
+#include "bind.h"
+
+namespace minion {
+
+void BindHandler::error(
+    std::string msg)
+{
+    position p = here();
+    throw MinionError(msg.append(" ... current position ")
+                          .append(std::to_string(p.line_n))
+                          .append(".")
+                          .append(std::to_string(p.byte_ix)));
+}
+
+// Where the current value belongs, for error messages
+std::string BindHandler::context()
+{
+    if (stack.empty())
+        return "as top-level element";
+    frame& f = stack.back();
+    if (f.type->element)
+        return std::string{"at index: "}.append(std::to_string(f.index - 1));
+    return std::string{"at key: "}.append(f.key);
+}
+
+void BindHandler::expecting(
+    const char* found)
+{
+    error(std::string{"Unexpected "}
+              .append(found)
+              .append(" whilst seeking ")
+              .append(target_type->what)
+              .append(" value ")
+              .append(context()));
+}
+
+// Set the target for a value in a list. In a map it is set by the key.
+void BindHandler::next_target()
+{
+    if (stack.empty())
+        return;
+    frame& f = stack.back();
+    if (f.type->element) {
+        target = f.type->element(f.obj);
+        target_type = f.type->element_type;
+        ++f.index;
+    }
+}
+
+// Follow the nesting of a macro definition, to find its end
+void BindHandler::macro_item(
+    int change)
+{
+    macro_depth += change;
+    if (macro_depth == 0)
+        in_macro = false;
+}
+
+// Pass the value of a macro to the handler, as though it were read again
+void BindHandler::replay(
+    MValue& m)
+{
+    if (auto ms = m.m_string())
+        on_string(**ms);
+    else if (auto ml = m.m_list()) {
+        on_list_begin();
+        for (auto& v : **ml)
+            replay(v);
+        on_list_end();
+    } else if (auto mm = m.m_map()) {
+        on_map_begin();
+        for (size_t i = 0; i < (*mm)->size(); ++i) {
+            MPair& mp = (*mm)->get_pair(i);
+            on_key(mp.first);
+            replay(mp.second);
+        }
+        on_map_end();
+    }
+}
+
+void BindHandler::on_string(
+    std::string_view s)
+{
+    if (in_macro) {
+        macros.on_string(s);
+        macro_item(0);
+        return;
+    }
+    if (skip_depth != 0)
+        return;
+    next_target();
+    if (!target_type)
+        return; // the value of an unknown key
+    if (!target_type->string)
+        expecting("string");
+    if (conversion c = target_type->string(target, s); c != conversion::ok) {
+        std::string msg = conversion_message(c, s, target_type->what);
+        if (!stack.empty())
+            msg.append(stack.back().type->element ? "List, " : "Map, ");
+        error(msg.append("seeking ")
+                  .append(target_type->what)
+                  .append(" value ")
+                  .append(context()));
+    }
+}
+
+void BindHandler::on_list_begin()
+{
+    if (in_macro) {
+        macros.on_list_begin();
+        macro_item(1);
+        return;
+    }
+    if (skip_depth != 0) {
+        ++skip_depth;
+        return;
+    }
+    next_target();
+    if (!target_type) {
+        skip_depth = 1;
+        return;
+    }
+    if (!target_type->element)
+        expecting("list");
+    target_type->clear(target);
+    stack.push_back({target, target_type, {}, 0});
+}
+
+void BindHandler::on_list_end()
+{
+    if (in_macro) {
+        macros.on_list_end();
+        macro_item(-1);
+        return;
+    }
+    if (skip_depth != 0) {
+        --skip_depth;
+        return;
+    }
+    stack.pop_back();
+}
+
+void BindHandler::on_map_begin()
+{
+    if (in_macro) {
+        macros.on_map_begin();
+        macro_item(1);
+        return;
+    }
+    if (skip_depth != 0) {
+        ++skip_depth;
+        return;
+    }
+    next_target();
+    if (!target_type) {
+        skip_depth = 1;
+        return;
+    }
+    if (!target_type->member)
+        expecting("map");
+    if (target_type->clear)
+        target_type->clear(target);
+    stack.push_back({target, target_type, {}, 0});
+}
+
+void BindHandler::on_map_end()
+{
+    on_list_end(); // the same
+}
+
+void BindHandler::on_key(
+    std::string_view k)
+{
+    if (in_macro) {
+        macros.on_key(k);
+        return;
+    }
+    if (skip_depth != 0)
+        return;
+    frame& f = stack.back();
+    target = f.type->member(f.obj, k, target_type, f.key);
+    if (!target) {
+        if (!ignore_unknown)
+            error(std::string{"Unknown key in map: "}.append(k));
+        target_type = nullptr;
+    }
+}
+
+void BindHandler::on_macro_def(
+    std::string_view name)
+{
+    macros.on_macro_def(name);
+    in_macro = true;
+    macro_depth = 0;
+}
+
+void BindHandler::on_macro_ref(
+    std::string_view name)
+{
+    if (in_macro) {
+        macros.on_macro_ref(name);
+        macro_item(0);
+        return;
+    }
+    if (skip_depth != 0)
+        return;
+    MValue m = macros.macro(name);
+    replay(m);
+}
+
+} // namespace minion
@@ -0,0 +1,316 @@
+#ifndef BIND_H
+#define BIND_H
+
+#include "minion.h"
+#include <array>
+#include <bit>
+#include <map>
+
+/* Reading a document directly into C++ structs, without building an
+ * `MValue` tree. The fields of a struct are declared in a specialization
+ * of `minion::schema`:
+ *
+ *     struct server
+ *     {
+ *         std::string host;
+ *         int port;
+ *         std::vector<std::string> aliases;
+ *     };
+ *
+ *     template<>
+ *     struct minion::schema<server>
+ *     {
+ *         static constexpr auto fields = minion::make_fields(
+ *             MINION_FIELD(server, host),
+ *             MINION_FIELD(server, port),
+ *             MINION_FIELD(server, aliases));
+ *     };
+ *
+ *     server s;
+ *     MValue e = minion::bind(input, s); // empty, or an error value
+ *
+ * A member can be a string, a type read by `convert` (integer, floating
+ * point, boolean, `std::chrono::duration`), a `std::vector` (read from a
+ * list), a `std::map<std::string, ...>` (read from a map with any keys)
+ * or another struct with a schema (read from a map). The keys of a
+ * struct are matched using a perfect hash table which is built at
+ * compile time. Fields which are not in the input are left unchanged, a
+ * key which is not a field is an error unless `ignore_unknown` is set.
+ * Macro values are kept (as `MValue`s) until they are used.
+ * The error messages give the position in the input of the item at which
+ * the problem was found, in the same form as those of the reader.
+ */
+
+namespace minion {
+
+template<typename T>
+struct schema;
+
+/* The operations for binding an item to an object of a particular type.
+ * Only those operations applicable to the type are set: `string` for a
+ * type read from a string, `element` for one read from a list and
+ * `member` for one read from a map.
+ */
+struct binder
+{
+    const char* what; // the expected item, for error messages
+    conversion (*string)(void* obj, std::string_view s);
+    void (*clear)(void* obj);
+    // Add an element to the list and return it
+    void* (*element)(void* obj);
+    const binder* element_type;
+    // Return the member with the given key (and its type and name), or
+    // null if there is none
+    void* (*member)(void* obj, std::string_view key, const binder*& type, std::string_view& name);
+};
+
+template<typename T>
+struct binding;
+
+template<typename T>
+inline constexpr binder binder_of = binding<T>::value;
+
+// An entry in the field table of a struct
+struct field_info
+{
+    std::string_view name;
+    void* (*member)(void* obj);
+    const binder* type;
+};
+
+template<auto M>
+struct member_pointer;
+
+template<typename S, typename V, V S::*M>
+struct member_pointer<M>
+{
+    using struct_type = S;
+    using value_type = V;
+
+    static void* get(
+        void* obj)
+    {
+        return &(static_cast<S*>(obj)->*M);
+    }
+};
+
+template<auto M>
+constexpr field_info field(
+    std::string_view name)
+{
+    using mp = member_pointer<M>;
+    return {name, &mp::get, &binder_of<typename mp::value_type>};
+}
+
+#define MINION_FIELD(type, member) ::minion::field<&type::member>(#member)
+
+// A hash of the key, which can be computed at compile time
+constexpr uint32_t key_hash(
+    std::string_view key, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    for (char ch : key) {
+        h ^= (unsigned char) ch;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/* The fields of a struct with a perfect hash table for finding them by
+ * key. The table has at least twice as many slots as there are fields,
+ * and a seed is chosen for which no two field names share a slot.
+ */
+template<size_t N>
+struct field_table
+{
+    static constexpr size_t n_slots = std::bit_ceil(2 * N + 1);
+
+    std::array<field_info, N> fields;
+    std::array<uint8_t, n_slots> slots{}; // 1 + index of the field, 0 if empty
+    uint32_t seed{0};
+
+    static_assert(N < 255, "minion::field_table: too many fields");
+
+    constexpr field_table(
+        std::array<field_info, N> f)
+        : fields{f}
+    {
+        for (seed = 1;; ++seed) {
+            slots = {};
+            size_t i = 0;
+            for (; i < N; ++i) {
+                uint8_t& slot = slots[key_hash(fields[i].name, seed) & (n_slots - 1)];
+                if (slot != 0) {
+                    // A compile-time error
+                    if (fields[slot - 1].name == fields[i].name)
+                        throw "minion::field_table: duplicate field name";
+                    break;
+                }
+                slot = i + 1;
+            }
+            if (i == N)
+                break;
+        }
+    }
+
+    const field_info* find(
+        std::string_view key) const
+    {
+        uint8_t slot = slots[key_hash(key, seed) & (n_slots - 1)];
+        if (slot != 0 && fields[slot - 1].name == key)
+            return &fields[slot - 1];
+        return nullptr;
+    }
+};
+
+template<typename... F>
+constexpr auto make_fields(
+    F... f)
+{
+    return field_table<sizeof...(F)>({f...});
+}
+
+/* Types read from a string by `convert`, and structs, which are read
+ * from a map. (Whether a struct has a schema can't be tested here, as it
+ * may be incomplete when the field table of a recursive struct is built.)
+ */
+template<typename T>
+struct binding
+{
+    static void* member(
+        void* obj, std::string_view key, const binder*& type, std::string_view& name)
+    {
+        const field_info* f = schema<T>::fields.find(key);
+        if (!f)
+            return nullptr;
+        type = f->type;
+        name = f->name;
+        return f->member(obj);
+    }
+
+    static constexpr binder make()
+    {
+        if constexpr (std::is_arithmetic_v<T> || is_duration<T>::value)
+            return {conversion_name<T>(),
+                    [](void* obj, std::string_view s) { return convert(s, *static_cast<T*>(obj)); },
+                    nullptr,
+                    nullptr,
+                    nullptr,
+                    nullptr};
+        else
+            return {"map", nullptr, nullptr, nullptr, nullptr, &member};
+    }
+
+    static constexpr binder value = make();
+};
+
+template<>
+struct binding<std::string>
+{
+    static constexpr binder value{
+        "string",
+        [](void* obj, std::string_view s) {
+            static_cast<std::string*>(obj)->assign(s);
+            return conversion::ok;
+        },
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr};
+};
+
+template<typename T>
+struct binding<std::vector<T>>
+{
+    static constexpr binder value{
+        "list",
+        nullptr,
+        [](void* obj) { static_cast<std::vector<T>*>(obj)->clear(); },
+        [](void* obj) -> void* { return &static_cast<std::vector<T>*>(obj)->emplace_back(); },
+        &binder_of<T>,
+        nullptr};
+};
+
+template<typename T>
+struct binding<std::map<std::string, T>>
+{
+    static void* member(
+        void* obj, std::string_view key, const binder*& type, std::string_view& name)
+    {
+        auto& m = *static_cast<std::map<std::string, T>*>(obj);
+        auto it = m.try_emplace(std::string{key}).first;
+        type = &binder_of<T>;
+        name = it->first;
+        return &it->second;
+    }
+
+    static constexpr binder value{
+        "map",
+        nullptr,
+        [](void* obj) { static_cast<std::map<std::string, T>*>(obj)->clear(); },
+        nullptr,
+        nullptr,
+        &member};
+};
+
+/* The handler which writes the items into the bound object. It can also
+ * be used with a `StreamReader`.
+ */
+class BindHandler : public Handler
+{
+    struct frame
+    {
+        void* obj; // the list or map being read
+        const binder* type;
+        std::string_view key; // the current key, for a map
+        size_t index;         // the number of elements, for a list
+    };
+    std::vector<frame> stack;
+    void* target;             // the object for the next value
+    const binder* target_type; // null if the value is to be skipped
+    std::string_view key;      // the key of the next value, in a map
+    bool ignore_unknown;
+    size_t skip_depth{0};
+
+    // Macro definitions are collected as `MValue`s
+    TreeBuilder macros;
+    bool in_macro{false};
+    int macro_depth{0};
+    void macro_item(int change);
+    void replay(MValue& m);
+
+    void next_target();
+    [[noreturn]] void error(std::string msg);
+    [[noreturn]] void expecting(const char* found);
+    std::string context();
+
+public:
+    BindHandler(
+        void* obj, const binder* type, bool ignore = false)
+        : target{obj}
+        , target_type{type}
+        , ignore_unknown{ignore}
+    {}
+
+    void on_string(std::string_view s) override;
+    void on_list_begin() override;
+    void on_list_end() override;
+    void on_map_begin() override;
+    void on_map_end() override;
+    void on_key(std::string_view k) override;
+    void on_macro_def(std::string_view name) override;
+    void on_macro_ref(std::string_view name) override;
+};
+
+// Read the input into `value`. The result is empty, or an error value.
+template<typename T>
+MValue bind(
+    std::string_view input, T& value, bool ignore_unknown = false)
+{
+    BindHandler h(&value, &binder_of<T>, ignore_unknown);
+    return Reader::read(input, h);
+}
+
+} // namespace minion
+
+#endif // BIND_H
@@ -0,0 +1,128 @@
+#include "cache.h"
+#include <cstring>
+
+namespace minion {
+
+namespace {
+
+uint64_t load64(
+    const char* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+
+// Multiply, folding the 128-bit product to 64 bits
+uint64_t mix(
+    uint64_t a, uint64_t b)
+{
+    __uint128_t r = __uint128_t(a) * b;
+    return uint64_t(r) ^ uint64_t(r >> 64);
+}
+
+constexpr uint64_t P0 = 0xa0761d6478bd642f;
+constexpr uint64_t P1 = 0xe7037ed1a0b428db;
+constexpr uint64_t P2 = 0x8ebc6af09c88c6e3;
+constexpr uint64_t P3 = 0x589965cc75374cc3;
+
+} // namespace
+
+/* Two independent 64-bit lanes (in the style of wyhash), each taking 16
+ * bytes per multiplication. The result depends on the byte order of the
+ * machine, which doesn't matter for a cache in memory.
+ */
+hash128 hash_bytes(
+    std::string_view s)
+{
+    const char* p = s.data();
+    size_t n = s.size();
+    uint64_t a = P0 ^ n;
+    uint64_t b = P1 ^ (n << 1);
+    for (; n >= 16; n -= 16, p += 16) {
+        uint64_t x = load64(p);
+        uint64_t y = load64(p + 8);
+        a = mix(x ^ P1 ^ a, y ^ P2);
+        b = mix(x ^ P3, y ^ P0 ^ b);
+    }
+    if (n != 0) {
+        char tail[16] = {};
+        std::memcpy(tail, p, n);
+        uint64_t x = load64(tail);
+        uint64_t y = load64(tail + 8);
+        a = mix(x ^ P1 ^ a, y ^ P2);
+        b = mix(x ^ P3, y ^ P0 ^ b);
+    }
+    return {mix(a ^ P0, b ^ P3), mix(b ^ P2, a ^ P1)};
+}
+
+//static
+ParseCache& ParseCache::global()
+{
+    static ParseCache cache;
+    return cache;
+}
+
+MValue ParseCache::read(
+    std::string_view s)
+{
+    key k{hash_bytes(s), s.size()};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(k);
+        if (it != index.end()) {
+            ++hits;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->value;
+        }
+        ++misses;
+    }
+    // Read without holding the lock. If another thread reads the same
+    // input meanwhile, the first result to arrive is kept.
+    MValue m = Reader::read(s);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (s.size() > limit || index.count(k) != 0)
+        return m;
+    entries.push_front({k, m});
+    index.emplace(k, entries.begin());
+    bytes += s.size();
+    evict();
+    return m;
+}
+
+// Drop the least recently used entries until the total size is within
+// the limit (the mutex must be held)
+void ParseCache::evict()
+{
+    while (bytes > limit) {
+        entry& e = entries.back();
+        bytes -= e.k.size;
+        index.erase(e.k);
+        entries.pop_back();
+        ++evictions;
+    }
+}
+
+ParseCache::statistics ParseCache::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return {hits, misses, evictions, entries.size(), bytes};
+}
+
+void ParseCache::set_limit(
+    size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    limit = max_bytes;
+    evict();
+}
+
+void ParseCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+} // namespace minion
@@ -0,0 +1,104 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "minion.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/* A cache of parse results, keyed by a 128-bit hash of the input (and
+ * its length), so that reading a byte-identical input again costs only
+ * the hash. The result is shared with the cache – and with every other
+ * reader of the same input – so it must not be modified.
+ * The cache holds the most recently used results up to a limit on the
+ * total size of their inputs (which serves as a measure of the memory
+ * they use); the least recently used are dropped first. An input larger
+ * than the limit is not cached. Errors are cached like other results.
+ * All operations are protected by a mutex, and a result may be read by
+ * several threads at once: reading it, including searching its maps
+ * (whose key indexes are built as they are read), doesn't change it.
+ * However, in a build with MINION_INTRUSIVE_REFCOUNT the reference counts
+ * of the shared results are not atomic, so the cache must then be used
+ * by only one thread. Nor may the typed `get` methods be used on results
+ * read by several threads in a build with MINION_CONVERSION_CACHE, as they
+ * store the converted value in the string (see convert.h).
+ */
+
+namespace minion {
+
+struct hash128
+{
+    uint64_t lo;
+    uint64_t hi;
+
+    bool operator==(const hash128&) const = default;
+};
+
+// A fast, non-cryptographic hash
+hash128 hash_bytes(std::string_view s);
+
+class ParseCache
+{
+    struct key
+    {
+        hash128 hash;
+        size_t size;
+
+        bool operator==(const key&) const = default;
+    };
+    struct key_hash
+    {
+        size_t operator()(const key& k) const { return k.hash.lo; }
+    };
+    struct entry
+    {
+        key k;
+        MValue value;
+    };
+
+    std::mutex mutex;
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
+    size_t limit;
+    size_t bytes{0};
+    size_t hits{0};
+    size_t misses{0};
+    size_t evictions{0};
+
+    void evict();
+
+public:
+    static constexpr size_t default_limit = 64 << 20;
+
+    ParseCache(
+        size_t max_bytes = default_limit)
+        : limit{max_bytes}
+    {}
+    ParseCache(const ParseCache&) = delete;
+    ParseCache& operator=(const ParseCache&) = delete;
+
+    // The cache shared by the whole process
+    static ParseCache& global();
+
+    // As `Reader::read`, but the result comes from the cache if the same
+    // input has been read before
+    MValue read(std::string_view s);
+
+    struct statistics
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+        size_t bytes; // total size of the cached inputs
+    };
+    statistics stats();
+
+    // Change the size limit, dropping entries if necessary
+    void set_limit(size_t max_bytes);
+    void clear();
+};
+
+} // namespace minion
+
+#endif // CACHE_H
@@ -0,0 +1,69 @@
+/* Test of minion_gen: the MINION and JSON forms of a generated document
+ * must describe the same data, whatever the output options.
+ * Usage: gen_test <path of minion_gen>
+ */
+
+#include "minion.h"
+#include <cstdio>
+#include <string>
+
+using namespace minion;
+
+namespace {
+
+// Run minion_gen, returning its output
+bool generate(
+    const std::string& command, std::string& output)
+{
+    FILE* p = popen(command.c_str(), "r");
+    if (!p)
+        return false;
+    output.clear();
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), p)) != 0)
+        output.append(buf, n);
+    return pclose(p) == 0;
+}
+
+// Read a generated document, returning it in compact form
+bool canonical(
+    const std::string& input, std::string& output)
+{
+    MValue m = Reader::read(input);
+    if (const char* e = m.error_message()) {
+        fprintf(stderr, "  %s\n", e);
+        return false;
+    }
+    output = Writer(m, -1).dump();
+    return true;
+}
+
+} // namespace
+
+int main(
+    int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <minion_gen>\n", argv[0]);
+        return 2;
+    }
+    const char* options[] = {
+        "",
+        "--comments=0.3",
+        "--macros=10 --macro-refs=0.2",
+        "--comments=0.2 --macros=5 --macro-refs=0.3 --pretty=2",
+        "--top=map --comments=0.5 --macros=8 --macro-refs=0.1",
+    };
+    int failures = 0;
+    for (const char* opts : options) {
+        std::string command = std::string{argv[1]} + " --seed=7 --size=64K " + opts;
+        std::string minion, json, m, j;
+        bool ok = generate(command, minion) && generate(command + " --json", json)
+                  && canonical(minion, m) && canonical(json, j) && m == j;
+        printf("%s: %s\n", ok ? "ok" : "FAILED", command.c_str());
+        if (!ok)
+            ++failures;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+#include "index.h"
+#include "tape.h" // T_Ref
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+namespace minion {
+
+namespace {
+
+/* Build the index from the reader's events. The items of macro
+ * definitions are not indexed: a macro reference is indexed as a single
+ * item, which is read as a whole.
+ */
+class IndexBuilder : public Handler
+{
+    std::vector<index_entry>& entries;
+    std::string& keys;
+    std::vector<size_t> stack; // open lists and maps
+    bool in_macro{false};
+    int macro_depth{0};
+
+    // Return false if the item is part of a macro definition
+    bool record(
+        int change)
+    {
+        if (!in_macro)
+            return true;
+        macro_depth += change;
+        if (macro_depth == 0)
+            in_macro = false;
+        return false;
+    }
+
+    void add(
+        uint32_t type)
+    {
+        if (!stack.empty()) {
+            // The elements of a map are counted by `on_key`
+            auto& c = entries[stack.back()];
+            if (c.type == T_List)
+                ++c.size;
+        }
+        entries.push_back({type, 0, offset(), entries.size() + 1});
+    }
+
+    void end()
+    {
+        entries[stack.back()].next = entries.size();
+        stack.pop_back();
+    }
+
+public:
+    IndexBuilder(
+        std::vector<index_entry>& e, std::string& k)
+        : entries{e}
+        , keys{k}
+    {}
+
+    void on_string(std::string_view) override
+    {
+        if (record(0))
+            add(T_String);
+    }
+    void on_list_begin() override
+    {
+        if (record(1)) {
+            add(T_List);
+            stack.push_back(entries.size() - 1);
+        }
+    }
+    void on_list_end() override
+    {
+        if (record(-1))
+            end();
+    }
+    void on_map_begin() override
+    {
+        if (record(1)) {
+            add(T_Map);
+            stack.push_back(entries.size() - 1);
+        }
+    }
+    void on_map_end() override
+    {
+        if (record(-1))
+            end();
+    }
+    void on_key(
+        std::string_view key) override
+    {
+        if (in_macro)
+            return;
+        ++entries[stack.back()].size;
+        entries.push_back({T_String, uint32_t(key.size()), keys.size(), entries.size() + 1});
+        keys.append(key);
+    }
+    void on_macro_def(std::string_view) override
+    {
+        in_macro = true;
+        macro_depth = 0;
+    }
+    void on_macro_ref(std::string_view) override
+    {
+        if (record(0))
+            add(T_Ref);
+    }
+};
+
+uint64_t get_u64(
+    const char* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = (v << 8) | (unsigned char) p[i];
+    return v;
+}
+
+void put_u64(
+    char* p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) {
+        p[i] = char(v & 0xFF);
+        v >>= 8;
+    }
+}
+
+// Split a path into its keys and indexes
+std::vector<std::string> split_path(
+    std::string_view path)
+{
+    std::vector<std::string> parts;
+    size_t p = 0;
+    while (p < path.size()) {
+        if (path[p] != '/')
+            throw MinionError(std::string{"IndexedFile: invalid path: "}.append(path));
+        std::string part;
+        for (++p; p < path.size() && path[p] != '/'; ++p) {
+            if (path[p] == '~' && p + 1 < path.size() && (path[p + 1] == '0' || path[p + 1] == '1'))
+                part.push_back(path[++p] == '0' ? '~' : '/');
+            else
+                part.push_back(path[p]);
+        }
+        parts.push_back(std::move(part));
+    }
+    return parts;
+}
+
+// A list index in a path: decimal digits only
+bool path_index(
+    const std::string& part, size_t& n)
+{
+    if (part.empty() || part.size() > 18)
+        return false;
+    n = 0;
+    for (char ch : part) {
+        if (ch < '0' || ch > '9')
+            return false;
+        n = n * 10 + (ch - '0');
+    }
+    return true;
+}
+
+} // namespace
+
+const char* IndexedFile::open(
+    const std::string& path, bool verify_hash)
+{
+    file = read_file(path);
+    struct stat st;
+    if (!file || stat(path.c_str(), &st) != 0) {
+        error_message = std::string{"Could not read file "}.append(path).append(": ").append(
+            strerror(errno));
+        return error_message.c_str();
+    }
+    input = file->view();
+    identity id{input.size(), int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, {0, 0}};
+    if (verify_hash)
+        id.hash = hash_bytes(input);
+
+    std::string ipath = sidecar_path(path);
+    if (!load(ipath, id, verify_hash)) {
+        if (build())
+            return error_message.c_str();
+        if (!verify_hash)
+            id.hash = hash_bytes(input);
+        save(ipath, id); // the index is still usable if it can't be saved
+    }
+
+    // Read the macro definitions
+    builder.stack.clear();
+    builder.macro_map.clear();
+    Reader r;
+    r.init(input, builder);
+    try {
+        r.get_macros();
+    } catch (MinionError& e) {
+        error_message = e.what();
+        return error_message.c_str();
+    }
+    macro_names = std::move(r.macro_map);
+    return nullptr;
+}
+
+// Read the whole file, building the index
+const char* IndexedFile::build()
+{
+    built_entries.clear();
+    built_keys.clear();
+    IndexBuilder ib(built_entries, built_keys);
+    MValue e = Reader::read(input, ib);
+    if (!e.is_null()) {
+        error_message = e.error_message();
+        entries = nullptr;
+        n_entries = 0;
+        return error_message.c_str();
+    }
+    entries = built_entries.data();
+    n_entries = built_entries.size();
+    keys = built_keys;
+    sidecar.reset();
+    loaded = false;
+    return nullptr;
+}
+
+// Load the sidecar index, if it is present and matches the file
+bool IndexedFile::load(
+    const std::string& path, identity& id, bool verify_hash)
+{
+    if constexpr (std::endian::native != std::endian::little)
+        return false; // the entries can't be used in place
+    auto f = read_file(path);
+    if (!f)
+        return false;
+    std::string_view s = f->view();
+    const char* h = s.data();
+    if (s.size() < header_size || std::memcmp(h, magic, 4) != 0
+        || (unsigned char) h[4] + ((unsigned char) h[5] << 8) != version)
+        return false;
+    if (get_u64(h + 8) != id.size || int64_t(get_u64(h + 16)) != id.mtime)
+        return false;
+    if (verify_hash && (get_u64(h + 24) != id.hash.lo || get_u64(h + 32) != id.hash.hi))
+        return false;
+    uint64_t n = get_u64(h + 40);
+    uint64_t k = get_u64(h + 48);
+    if (n > s.size() / sizeof(index_entry) || header_size + n * sizeof(index_entry) + k != s.size())
+        return false;
+    auto e = reinterpret_cast<const index_entry*>(h + header_size);
+    std::string_view kt = s.substr(header_size + n * sizeof(index_entry));
+    // Check the entries, so that a damaged index can't lead outside the
+    // file or the index
+    for (uint64_t i = 0; i < n; ++i) {
+        if (e[i].next <= i || e[i].next > n || e[i].offset > input.size())
+            return false;
+        if (e[i].type != T_String && e[i].type != T_List && e[i].type != T_Map && e[i].type != T_Ref)
+            return false;
+        if (e[i].size != 0 && e[i].type == T_String && e[i].offset + e[i].size > kt.size())
+            return false; // a key (other strings have no size)
+    }
+    sidecar = f;
+    entries = e;
+    n_entries = n;
+    keys = kt;
+    built_entries.clear();
+    built_keys.clear();
+    loaded = true;
+    return true;
+}
+
+// Write the index to a temporary file, which then replaces the sidecar
+bool IndexedFile::save(
+    const std::string& path, identity& id)
+{
+    char h[header_size] = {};
+    std::memcpy(h, magic, 4);
+    h[4] = char(version & 0xFF);
+    h[5] = char(version >> 8);
+    put_u64(h + 8, id.size);
+    put_u64(h + 16, id.mtime);
+    put_u64(h + 24, id.hash.lo);
+    put_u64(h + 32, id.hash.hi);
+    put_u64(h + 40, n_entries);
+    put_u64(h + 48, keys.size());
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(h, 1, header_size, fp) == header_size
+              && fwrite(entries, sizeof(index_entry), n_entries, fp) == n_entries
+              && fwrite(keys.data(), 1, keys.size(), fp) == keys.size();
+    if (fclose(fp) != 0 || !ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Read the item starting at the given position
+MValue IndexedFile::read_at(
+    uint64_t offset)
+{
+    Reader r;
+    r.init(input, builder);
+    r.ch_index = offset;
+    r.macro_map.swap(macro_names);
+    try {
+        r.get_value(r.get_token(), "indexed item");
+    } catch (MinionError& e) {
+        // Only possible if the file has changed since it was opened
+        r.macro_map.swap(macro_names);
+        builder.stack.clear();
+        return e;
+    }
+    r.macro_map.swap(macro_names);
+    return std::move(builder.result);
+}
+
+MValue IndexedFile::get(
+    std::string_view path)
+{
+    if (!entries)
+        return {};
+    auto parts = split_path(path);
+    size_t i = 0; // the top-level item
+    for (size_t p = 0; p < parts.size(); ++p) {
+        const index_entry& e = entries[i];
+        if (e.type == T_List) {
+            size_t n;
+            if (!path_index(parts[p], n) || n >= e.size)
+                return {};
+            for (i = i + 1; n != 0 && i < n_entries; --n)
+                i = entries[i].next;
+        } else if (e.type == T_Map) {
+            size_t j = i + 1;
+            for (size_t n = e.size; n != 0; --n) {
+                if (j + 1 >= n_entries)
+                    return {};
+                const index_entry& k = entries[j];
+                if (k.size == parts[p].size()
+                    && std::memcmp(keys.data() + k.offset, parts[p].data(), k.size) == 0)
+                    break;
+                j = entries[j + 1].next;
+            }
+            if (j + 1 >= e.next)
+                return {}; // not found
+            i = j + 1;
+        } else if (e.type == T_Ref) {
+            // The rest of the path is within the value of a macro
+            MValue m = read_at(e.offset);
+            for (; p < parts.size(); ++p) {
+                if (auto ml = m.m_list()) {
+                    size_t n;
+                    if (!path_index(parts[p], n) || n >= (*ml)->size())
+                        return {};
+                    m = (**ml)[n];
+                } else if (auto mm = m.m_map()) {
+                    MValue* v = (*mm)->find(parts[p]);
+                    if (!v)
+                        return {};
+                    m = *v;
+                } else
+                    return {};
+            }
+            return m;
+        } else
+            return {};
+        if (i >= n_entries)
+            return {};
+    }
+    return read_at(entries[i].offset);
+}
+
+} // namespace minion
@@ -0,0 +1,101 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "cache.h"
+#include "filedata.h"
+#include "minion.h"
+
+/* Random access to the items of a large document file by path, using a
+ * structural index which is saved in a sidecar file ("<file>.mindex").
+ * The index records, in input order, the position in the file of every
+ * item, with the keys of the maps and the extent of each list and map,
+ * so that an item can be found without reading anything before it; only
+ * the item itself (and the macro definitions) are then read.
+ * The sidecar records the size, modification time and hash of the file
+ * it was made from. If any of these differ – or the sidecar is missing
+ * or damaged – the file is read in full to build a new index, which is
+ * saved if possible.
+ *
+ * The sidecar is little-endian and versioned:
+ *   header (64 bytes): "MINX", version (u16), flags (u16), file size,
+ *       modification time (ns), hash (128 bits), number of entries, size
+ *       of the key table, and 8 bytes unused (all u64 unless stated)
+ *   entries (24 bytes each): type (u32), size (u32), offset (u64), next
+ *       (u64)
+ *   key table
+ * The entries are in input order, the elements of a map being its keys
+ * and values alternately (as in a Tape). For a key, `offset` and `size`
+ * give its text in the key table. For other items `offset` is the
+ * position of the item in the file, `size` the number of elements of a
+ * list or map. `next` is the index of the entry following the item.
+ * The sidecar is mapped into memory and used in place.
+ */
+
+namespace minion {
+
+struct index_entry
+{
+    uint32_t type; // T_String, T_List, T_Map or T_Ref
+    uint32_t size;
+    uint64_t offset;
+    uint64_t next;
+};
+
+class IndexedFile
+{
+    std::shared_ptr<FileData> file;
+    std::string_view input;
+
+    // The index, either built here or in the mapped sidecar
+    std::vector<index_entry> built_entries;
+    std::string built_keys;
+    std::shared_ptr<FileData> sidecar;
+    const index_entry* entries{nullptr};
+    size_t n_entries{0};
+    std::string_view keys;
+    bool loaded{false};
+
+    // The macro definitions, read when the file is opened
+    TreeBuilder builder;
+    MMap macro_names;
+
+    struct identity
+    {
+        uint64_t size;
+        int64_t mtime;
+        hash128 hash;
+    };
+
+    bool load(const std::string& path, identity& id, bool verify_hash);
+    bool save(const std::string& path, identity& id);
+    const char* build();
+    MValue read_at(uint64_t offset);
+
+    std::string error_message;
+
+public:
+    static constexpr char magic[4] = {'M', 'I', 'N', 'X'};
+    static constexpr uint16_t version = 1;
+    static constexpr size_t header_size = 64;
+
+    static std::string sidecar_path(const std::string& path) { return path + ".mindex"; }
+
+    // Open the file, using its sidecar index if it is up to date, otherwise
+    // building (and saving) a new one. If `verify_hash` is false, the index
+    // is trusted if the size and modification time of the file match.
+    // Return nullptr if successful, otherwise an error message.
+    const char* open(const std::string& path, bool verify_hash = true);
+
+    // True if the index was loaded from the sidecar, rather than built
+    bool index_loaded() { return loaded; }
+
+    // The item at the given path, e.g. "/section/key/3", with map keys
+    // and list indexes separated by '/' ("" is the whole document). In a
+    // key, "~1" stands for '/' and "~0" for '~'. The result is empty if
+    // there is no such item.
+    MValue get(std::string_view path);
+};
+
+} // namespace minion
+
+#endif // INDEX_H
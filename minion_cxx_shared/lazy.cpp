@@ -0,0 +1,164 @@
+#include "minion.h"
+#include <algorithm>
+
+namespace minion {
+
+/* Lazy reading. A quick scan of the top-level list or map (`prescan`),
+ * which only follows nesting, strings and comments, records the extent
+ * of every list and map within it. Only the top-level item is then read;
+ * each list or map within it is added as an empty list or map with a
+ * reference to its span. When this is first accessed (through
+ * `MValue::m_list` or `MValue::m_map`), its contents are read from the
+ * span by a `Reader` set up with the line information recorded by the
+ * scan – again leaving the lists and maps within it unread – so that
+ * positions in error messages are the same as for a normal read.
+ * The macro definitions are read in the normal way, before the scan.
+ */
+
+// The input and scan results, shared by all the unread lists and maps
+// of a document
+struct LazySource
+{
+    std::string_view input;
+    std::vector<lazy_span> spans; // in input order
+    MMap macro_names;             // for the reader's checks
+    MMap macros;                  // the values
+};
+
+struct LazyContent
+{
+    std::shared_ptr<LazySource> source;
+    size_t span;
+};
+
+namespace {
+
+// A tree builder which takes macro values from the shared source, rather
+// than a copy of them
+class LazyBuilder : public TreeBuilder
+{
+    LazySource& source;
+
+public:
+    LazyBuilder(
+        LazySource& s)
+        : source{s}
+    {}
+
+    void on_macro_ref(
+        std::string_view name) override
+    {
+        add(source.macros.get(name));
+    }
+};
+
+} // namespace
+
+// A list or map has been opened: add it, unread, and move to its end
+void Reader::skip_lazy(
+    bool in_map)
+{
+    auto& spans = lazy->spans;
+    size_t start = ch_index - 1;
+    auto it = std::lower_bound(spans.begin(), spans.end(), start, [](const lazy_span& sp, size_t p) {
+        return sp.start < p;
+    });
+    if (it == spans.end() || it->start != start)
+        error("[BUG] lazy reading: list or map not found by scan");
+    auto content = std::make_shared<LazyContent>(LazyContent{lazy, size_t(it - spans.begin())});
+    MValue m;
+    if (in_map) {
+        MMap mm;
+        mm.lazy = std::move(content);
+        m = mm;
+    } else {
+        MList ml;
+        ml.lazy = std::move(content);
+        m = ml;
+    }
+    static_cast<TreeBuilder*>(handler)->add(std::move(m));
+    ch_index = it->end;
+    line_index = it->end_line_index;
+    ch_linestart = it->end_line_start;
+}
+
+//static
+MValue Reader::read_span(
+    LazyContent& content)
+{
+    LazySource& source = *content.source;
+    lazy_span& sp = source.spans[content.span];
+    LazyBuilder builder(source);
+    Reader r;
+    r.init(source.input.substr(0, sp.end), builder);
+    r.lazy = content.source;
+    r.ch_index = sp.start + 1;
+    r.line_index = sp.line_index;
+    r.ch_linestart = sp.line_start;
+    // Borrow the macro names, rather than copying them
+    r.macro_map.swap(source.macro_names);
+    try {
+        if (source.input[sp.start] == '[')
+            r.get_list();
+        else
+            r.get_map();
+    } catch (...) {
+        r.macro_map.swap(source.macro_names);
+        throw;
+    }
+    r.macro_map.swap(source.macro_names);
+    return builder.result;
+}
+
+void MList::expand()
+{
+    MValue m = Reader::read_span(*lazy);
+    lazy.reset();
+    swap(**m.m_list());
+}
+
+void MMap::expand()
+{
+    MValue m = Reader::read_span(*lazy);
+    lazy.reset();
+    swap(**m.m_map());
+}
+
+//static
+MValue Reader::read_lazy(
+    std::string_view s)
+{
+    auto source = std::make_shared<LazySource>();
+    source->input = s;
+    TreeBuilder builder;
+    Reader r;
+    r.init(s, builder);
+    try {
+        int t = r.get_macros();
+        if (t != Token_StartList && t != Token_StartMap)
+            return read(s); // nothing to defer
+        size_t start = r.ch_index;
+        size_t line_index = r.line_index;
+        size_t line_start = r.ch_linestart;
+        std::vector<segment> segments;
+        if (!r.prescan(segments, SIZE_MAX, &source->spans) || r.get_token() != Token_End)
+            return read(s); // report the error in the normal way
+        r.ch_index = start;
+        r.line_index = line_index;
+        r.ch_linestart = line_start;
+        r.lazy = source;
+        if (t == Token_StartList)
+            r.get_list();
+        else
+            r.get_map();
+        if (r.get_token() != Token_End)
+            return read(s);
+    } catch (MinionError&) {
+        return read(s);
+    }
+    source->macro_names = std::move(r.macro_map);
+    source->macros = std::move(builder.macro_map);
+    return builder.result;
+}
+
+} // namespace minion
@@ -1,11 +1,24 @@
-#include "iofile.h"
+#include "filedata.h"
 #include "minion.h"
+#include "tape.h"
 #include <cstdio>
 #include <cstdlib>
 #include <time.h>
 
 using namespace minion;
 
+// Count the items, without building a tree
+struct Counter : Handler
+{
+    int strings = 0;
+    int lists = 0;
+    int maps = 0;
+
+    void on_string(std::string_view) override { ++strings; }
+    void on_list_begin() override { ++lists; }
+    void on_map_begin() override { ++maps; }
+};
+
 int main()
 {
     auto fplist = {
@@ -20,7 +33,8 @@ int main()
         //
     };
 
-    std::string indata;
+    std::shared_ptr<FileData> file;
+    std::string_view indata;
 
     struct timespec start, end, xtra;
 
@@ -28,12 +42,12 @@ int main()
 
     for (int count = 0; count < 10; ++count) {
         for (const auto& fp : fplist) {
-            const char* f = read_file(fp);
-            if (!f) {
+            file = read_file(fp);
+            if (!file) {
                 printf("File not found: %s\n", fp);
                 exit(1);
             }
-            indata = f;
+            indata = file->view();
 
             clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start); // Initial timestamp
 
@@ -46,11 +60,11 @@ int main()
 
             clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &xtra); // Get current time
 
-            double elapsed = end.tv_sec - start.tv_sec;
+            double elapsed = (end.tv_sec - start.tv_sec) * 1e6;
             elapsed += (end.tv_nsec - start.tv_nsec) / 1000.0;
             printf("%0.2f microseconds elapsed\n", elapsed);
 
-            elapsed = xtra.tv_sec - end.tv_sec;
+            elapsed = (xtra.tv_sec - end.tv_sec) * 1e6;
             elapsed += (xtra.tv_nsec - end.tv_nsec) / 1000.0;
             printf("%0.2f microseconds dumping\n", elapsed);
         }
@@ -69,6 +83,39 @@ int main()
             printf("*** Dump failed\n");        
     }
 
+    // The same input, fed to the incremental reader in small chunks
+    {
+        StreamReader sr;
+        std::string_view sv{indata};
+        for (size_t i = 0; i < sv.size(); i += 64)
+            sr.feed(sv.substr(i, 64));
+        MValue ms = sr.finish();
+        Writer w1(m, 0);
+        Writer w2(ms, 0);
+        printf("\nStreamed (64-byte chunks): %s\n",
+               w1.dump() == w2.dump() ? "same result" : "*** DIFFERENT RESULT");
+    }
+
+    {
+        Counter c;
+        MValue e = Reader::read(indata, c);
+        if (e.is_null())
+            printf("Handler: %d strings, %d lists, %d maps\n", c.strings, c.lists, c.maps);
+        else
+            printf("Handler: %s\n", e.error_message());
+    }
+
+    {
+        Tape tape;
+        const char* e = tape.read(indata);
+        if (e)
+            printf("Tape: %s\n", e);
+        else
+            printf("Tape: %zu elements at top level, %zu bytes\n",
+                   tape.root().size(),
+                   tape.memory());
+    }
+
     printf("\n ++++++++++++++++++\n");
     std::string s{"{\"A\": \"a\",\n\"B\": \"b\"}"};
     printf("IN: %s\n", s.c_str());
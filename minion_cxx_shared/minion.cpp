@@ -1,20 +1,10 @@
 #include "minion.h"
+#include <algorithm>
+#include <cctype>
 #include <map>
 
 namespace minion {
 
-enum tokens {
-    Token_End = 0,
-    Token_StartList,
-    Token_EndList,
-    Token_StartMap,
-    Token_EndMap,
-    Token_Comma,
-    Token_Colon,
-    Token_Macro,
-    Token_String
-};
-
 inline const std::map<int, std::string> token_text_map{{Token_End, "end of data"},
                                                        {Token_StartList, "'['"},
                                                        {Token_EndList, "']'"},
@@ -27,33 +17,22 @@ std::string Reader::token_text(
     int token)
 {
     if (token == Token_String || token == Token_Macro)
-        return "\"" + ch_buffer + "\"";
+        return std::string{"\""}.append(string_item).append("\"");
     return token_text_map.at(token);
 }
 
-// Read a string as an `int` value, taking an optional context string
-// for error reports.
-int string2int(
-    std::string& s, std::string_view context = "")
+// Report a failed conversion of a string value
+std::string conversion_message(
+    conversion c, std::string_view s, const char* what)
 {
-    int i;
-    try {
-        size_t index;
-        i = std::stoi(s, &index, 0);
-        if (index != s.size())
-            throw "";
-    } catch (std::out_of_range& e) {
-        std::string msg{"Integer out of range: " + s};
-        if (!context.empty())
-            msg.append("\n  context: ").append(context);
-        throw MinionError(msg);
-    } catch (...) {
-        std::string msg{"Invalid integer: " + s};
-        if (!context.empty())
-            msg.append("\n  context: ").append(context);
-        throw MinionError(msg);
-    }
-    return i;
+    std::string msg;
+    if (c == conversion::out_of_range) {
+        msg = what;
+        msg[0] = std::toupper(msg[0]);
+        msg.append(" out of range: ");
+    } else
+        msg.append("Invalid ").append(what).append(": ");
+    return msg.append(s).append("\n  context: ");
 }
 
 // Represent number as a string with hexadecimal digits, at least minwidth.
@@ -77,7 +56,7 @@ char Reader::read_ch(
 {
     if (ch_index >= input.size())
         return 0;
-    char ch = input.at(ch_index);
+    char ch = input[ch_index];
     ++ch_index;
     if (ch == '\n') {
         ++line_index;
@@ -135,22 +114,29 @@ void Reader::error(
     throw MinionError(mx);
 }
 
-// The result is available in `ch_buffer`.
+// The result is available in `string_item`, which refers to the input.
 void Reader::get_bare_string(
     char ch)
 {
-    ch_buffer.clear();
+    size_t start = ch_index - 1; // `ch` has already been read
+    string_in_input = true;
     while (true) {
-        ch_buffer.push_back(ch);
+        // Skip any following run of ordinary characters in one step
+        ch_index = scanner.find(ch_index, C_Space | C_Control | C_Quote | C_Structural);
         switch (ch = read_ch(false)) {
         case ':':
         case ',':
         case ']':
         case '}':
             unread_ch();
+            string_item = input.substr(start, ch_index - start);
+            return;
         case ' ':
         case '\n':
+            string_item = input.substr(start, ch_index - 1 - start);
+            return;
         case 0:
+            string_item = input.substr(start, ch_index - start);
             return;
         case '{':
         case '[':
@@ -164,16 +150,24 @@ void Reader::get_bare_string(
     }
 }
 
-// The result is available in `ch_buffer`.
+// The result is available in `string_item`.
 void Reader::get_string()
 {
     // +++ a delimited string (terminated by '"')
     // Escapes, introduced by '\', are possible. These are an extension
     // of the JSON escapes – see the MINION specification.
+    // Until an escape is found, the string is just a section of the input.
+    // Only then is it copied to `ch_buffer`, where the escapes are decoded.
     char ch;
-    ch_buffer.clear();
+    size_t start = ch_index;
+    string_in_input = true;
     position start_pos = here();
     while (true) {
+        // Take any run of characters needing no special treatment in one step
+        size_t end = scanner.find(ch_index, C_Quote | C_Control);
+        if (!string_in_input)
+            ch_buffer.append(input, ch_index, end - ch_index);
+        ch_index = end;
         ch = read_ch(true);
         if (ch == '"')
             break;
@@ -182,6 +176,10 @@ void Reader::get_string()
                       .append(pos(start_pos)));
         }
         if (ch == '\\') {
+            if (string_in_input) {
+                ch_buffer.assign(input, start, ch_index - 1 - start);
+                string_in_input = false;
+            }
             ch = read_ch(false); // '\n' etc. are permitted here
             switch (ch) {
             case '"':
@@ -234,6 +232,7 @@ void Reader::get_string()
                                       .append(pos(comment_pos)));
                         }
                         // loop with next character
+                        ch_index = scanner.find(ch_index, C_Quote | C_Control);
                         ch = read_ch(false);
                     }
                 }
@@ -244,23 +243,25 @@ void Reader::get_string()
         }
         ch_buffer.push_back(ch);
     }
+    if (string_in_input)
+        string_item = input.substr(start, ch_index - 1 - start);
+    else
+        string_item = ch_buffer;
 }
 
-MValue Reader::get_macro(
+void Reader::check_macro(
     std::string_view s)
 {
-    auto m = macro_map.get(s);
-    if (m.is_null())
+    if (macro_map.search(s) < 0 && !(library && library->macros.search(s) >= 0))
         error(std::string("Unknown macro name: ")
                   .append(s)
                   .append(" ... current position ")
                   .append(pos(here())));
-    return m;
 }
 
 /* Read the next lexical "token" from the input.
  * If it is a string or a macro name, the actual string will be available
- * in `ch_buffer`.
+ * in `string_item`.
  * If the input is invalid, a MinionError exception will be thrown,
  * containing a message.
  */
@@ -268,6 +269,8 @@ int Reader::get_token()
 {
     char ch;
     while (true) {
+        ch_index = scanner.skip_space(ch_index, line_index, ch_linestart);
+        token_start = ch_index;
         switch (ch = read_ch(false)) {
             // Act according to the next input character.
         case 0: // end of input, no next item
@@ -312,6 +315,7 @@ int Reader::get_token()
                                   .append(pos(comment_pos)));
                     }
                     // Comment loop ... read next character
+                    ch_index = scanner.find(ch_index, C_Structural | C_Control);
                     ch = read_ch(false);
                 }
                 // End of extended comment
@@ -321,6 +325,7 @@ int Reader::get_token()
                     if (ch == '\n' || ch == 0) {
                         break;
                     }
+                    ch_index = scanner.find(ch_index, C_Control);
                     ch = read_ch(false);
                 }
             }
@@ -332,59 +337,76 @@ int Reader::get_token()
     }
 }
 
-MValue Reader::get_list()
+// Pass a value, starting with token `t`, to the handler. If `t` cannot
+// start a value, report an error, with `context` describing the item sought.
+void Reader::get_value(
+    int t, std::string_view context)
 {
-    MList mlist;
+    switch (t) {
+    case Token_String:
+        handler->on_string(string_item);
+        break;
+    case Token_StartList:
+        if (lazy)
+            skip_lazy(false);
+        else
+            get_list();
+        break;
+    case Token_StartMap:
+        if (lazy)
+            skip_lazy(true);
+        else
+            get_map();
+        break;
+    case Token_Macro:
+        check_macro(string_item);
+        handler->on_macro_ref(string_item);
+        break;
+    default:
+        error(std::string("Unexpected item whilst seeking ")
+                  .append(context)
+                  .append(": ")
+                  .append(token_text(t))
+                  .append(" ... current position ")
+                  .append(pos(here())));
+    }
+}
+
+void Reader::get_list()
+{
+    handler->on_list_begin();
     while (true) {
         auto t = get_token();
-        switch (t) {
-        case Token_EndList:
-            return mlist;
-        case Token_String:
-            mlist.emplace_back(ch_buffer);
-            break;
-        case Token_StartList:
-            mlist.emplace_back(get_list());
-            break;
-        case Token_StartMap:
-            mlist.emplace_back(get_map());
-            break;
-        case Token_Macro:
-            mlist.emplace_back(get_macro(ch_buffer));
+        if (t == Token_EndList)
             break;
-        default:
-            error(std::string("Unexpected item whilst seeking list element: ")
-                      .append(token_text(t))
-                      .append(" ... current position ")
-                      .append(pos(here())));
-        }
+        get_value(t, "list element");
         t = get_token();
         if (t == Token_Comma)
             continue;
         if (t == Token_EndList)
-            return mlist;
+            break;
         error(std::string("Unexpected item whilst seeking comma in list: ")
                   .append(token_text(t))
                   .append(" ... current position ")
                   .append(pos(here())));
     }
+    handler->on_list_end();
 }
 
-MValue Reader::get_map()
+void Reader::get_map()
 {
-    MMap mmap;
-    std::string key;
+    handler->on_map_begin();
     while (true) {
         auto t = get_token();
         if (t != Token_String) {
             if (t == Token_EndMap)
-                return mmap;
+                break;
             error(std::string("Unexpected item whilst seeking map element key: ")
                       .append(token_text(t))
                       .append(" ... current position ")
                       .append(pos(here())));
         }
-        key = ch_buffer;
+        handler->on_key(string_item);
         t = get_token();
         if (t != Token_Colon) {
             error(std::string("Unexpected item whilst seeking map element colon: ")
@@ -392,35 +414,18 @@ MValue Reader::get_map()
                       .append(" ... current position ")
                       .append(pos(here())));
         }
-        switch (t = get_token()) {
-        case Token_String:
-            mmap.emplace_back(key, ch_buffer);
-            break;
-        case Token_StartList:
-            mmap.emplace_back(key, get_list());
-            break;
-        case Token_StartMap:
-            mmap.emplace_back(key, get_map());
-            break;
-        case Token_Macro:
-            mmap.emplace_back(key, get_macro(ch_buffer));
-            break;
-        default:
-            error(std::string("Unexpected item whilst seeking map element value: ")
-                      .append(token_text(t))
-                      .append(" ... current position ")
-                      .append(pos(here())));
-        }
+        get_value(get_token(), "map element value");
         t = get_token();
         if (t == Token_Comma)
             continue;
         if (t == Token_EndMap)
-            return mmap;
+            break;
         error(std::string("Unexpected item whilst seeking comma in map: ")
                   .append(token_text(t))
                   .append(" ... current position ")
                   .append(pos(here())));
     }
+    handler->on_map_end();
 }
 
 // Convert a unicode code point (as hex string) to a UTF-8 string
@@ -470,166 +475,317 @@ bool Reader::add_unicode_to_ch_buffer(
 MValue Reader::read(
     std::string_view s)
 {
-    return Reader(s).result;
+    return ReadContext::local().read(s);
 }
 
-Reader::Reader(
-    std::string_view input_string)
-    : input{input_string}
-    , ch_index{0}
-    , line_index{0}
-    , ch_linestart{0}
+//static
+MValue Reader::read(
+    std::string_view s, Handler& h)
 {
-    std::string key;
+    return Reader(s, h).result;
+}
+
+//static
+MValue Reader::read(
+    std::string_view s, MacroLibrary& lib)
+{
+    return ReadContext::local().read(s, &lib);
+}
+
+//static
+ReadContext& ReadContext::local()
+{
+    thread_local ReadContext context;
+    return context;
+}
+
+MValue ReadContext::read(
+    std::string_view s, MacroLibrary* lib)
+{
+    if (busy) {
+        // A read started during another one (by a handler, say)
+        ReadContext c;
+        return c.read(s, lib);
+    }
+    busy = true;
+    builder.library = lib;
+    reader.library = lib;
     try {
-        while (true) {
-            auto t = get_token();
-            switch (t) {
-            case Token_String:
-                result = ch_buffer;
-                break;
-            case Token_StartList:
-                result = get_list();
-                break;
-            case Token_StartMap:
-                result = get_map();
-                break;
-            case Token_Macro:
-                key = ch_buffer;
-                t = get_token();
-                if (t != Token_Colon) {
-                    error(std::string("Unexpected item whilst seeking macro definition colon: ")
-                              .append(token_text(t))
-                              .append(" ... current position ")
-                              .append(pos(here())));
-                }
-                switch (t = get_token()) {
-                case Token_String:
-                    macro_map.emplace_back(key, ch_buffer);
-                    break;
-                case Token_StartList:
-                    macro_map.emplace_back(key, get_list());
-                    break;
-                case Token_StartMap:
-                    macro_map.emplace_back(key, get_map());
-                    break;
-                case Token_Macro:
-                    macro_map.emplace_back(key, get_macro(ch_buffer));
-                    break;
-                default:
-                    error(std::string("Unexpected item whilst seeking macro definition value: ")
-                              .append(token_text(t))
-                              .append(" ... current position ")
-                              .append(pos(here())));
-                }
-                t = get_token();
-                if (t == Token_Comma)
-                    continue;
-                error(std::string("Expecting comma after macro definition, unexpected item: ")
-                          .append(token_text(t))
-                          .append(" ... current position ")
-                          .append(pos(here())));
-                break; // unreachable
-            default:
-                error(std::string("Unexpected item whilst seeking top-level element: ")
-                          .append(token_text(t))
-                          .append(" ... current position ")
-                          .append(pos(here())));
-            }
-            t = get_token();
-            if (t == Token_End)
-                break;
-            error(std::string("Expecting end of data, unexpected item: ")
+        reader.read_document(s, builder);
+    } catch (...) {
+        builder.stack.clear();
+        builder.macro_map.clear();
+        builder.in_macro = false;
+        busy = false;
+        throw;
+    }
+    // Keep the buffers, but not the values
+    MValue e = std::move(reader.result);
+    MValue m = std::move(builder.result);
+    reader.result = {};
+    builder.result = {};
+    builder.stack.clear();
+    builder.macro_map.clear();
+    builder.in_macro = false;
+    busy = false;
+    if (e.is_null())
+        return m;
+    return e;
+}
+
+//static
+MValue Reader::read(
+    std::string_view s, MacroLibrary& lib, Handler& h)
+{
+    return Reader(s, h, &lib).result;
+}
+
+MValue MacroLibrary::read(
+    std::string_view s)
+{
+    macros.clear();
+    TreeBuilder builder;
+    Reader r;
+    r.init(s, builder);
+    try {
+        auto t = r.get_macros();
+        if (t != Token_End)
+            r.error(std::string("Expecting end of macro library, unexpected item: ")
+                        .append(r.token_text(t))
+                        .append(" ... current position ")
+                        .append(r.pos(r.here())));
+    } catch (MinionError& e) {
+        return e;
+    }
+    macros = std::move(builder.macro_map);
+    return {};
+}
+
+position Handler::here()
+{
+    return reader ? reader->here() : position{0, 0};
+}
+
+size_t Handler::offset()
+{
+    return reader ? reader->token_start : 0;
+}
+
+void Reader::init(
+    std::string_view s, Handler& h)
+{
+    handler = &h;
+    h.reader = this;
+    macro_map.clear();
+    input = s;
+    ch_index = 0;
+    line_index = 0;
+    ch_linestart = 0;
+    scanner.reset(input);
+}
+
+// Read any macro definitions at the start of the input, returning the
+// token which follows them.
+int Reader::get_macros()
+{
+    std::string key;
+    while (true) {
+        auto t = get_token();
+        if (t != Token_Macro)
+            return t;
+        key = string_item;
+        t = get_token();
+        if (t != Token_Colon) {
+            error(std::string("Unexpected item whilst seeking macro definition colon: ")
                       .append(token_text(t))
                       .append(" ... current position ")
                       .append(pos(here())));
         }
+        handler->on_macro_def(key);
+        get_value(get_token(), "macro definition value");
+        macro_map.emplace_back(std::move(key), MValue{});
+        t = get_token();
+        if (t != Token_Comma)
+            error(std::string("Expecting comma after macro definition, unexpected item: ")
+                      .append(token_text(t))
+                      .append(" ... current position ")
+                      .append(pos(here())));
+    }
+}
 
+Reader::Reader(
+    std::string_view input_string, Handler& h, MacroLibrary* lib)
+    : library{lib}
+{
+    read_document(input_string, h);
+}
+
+// Read a whole document, leaving an error value in `result` if it fails
+void Reader::read_document(
+    std::string_view input_string, Handler& h)
+{
+    init(input_string, h);
+    try {
+        get_value(get_macros(), "top-level element");
+        auto t = get_token();
+        if (t != Token_End)
+            error(std::string("Expecting end of data, unexpected item: ")
+                      .append(token_text(t))
+                      .append(" ... current position ")
+                      .append(pos(here())));
     } catch (MinionError& e) {
         result = e;
     }
 }
 
+void TreeBuilder::add(
+    MValue m)
+{
+    if (!stack.empty()) {
+        frame& f = stack.back();
+        if (auto l = f.value.m_list())
+            (*l)->emplace_back(std::move(m));
+        else
+            (*f.value.m_map())->emplace_back(std::move(f.key), std::move(m));
+    } else if (in_macro) {
+        macro_map.emplace_back(std::move(macro_name), std::move(m));
+        in_macro = false;
+    } else
+        result = std::move(m);
+}
+
+size_t TreeBuilder::size_hint()
+{
+    size_t depth = stack.size() - 1;
+    return depth < size_hints.size() ? size_hints[depth] : 0;
+}
+
+void TreeBuilder::set_size_hint(
+    size_t n)
+{
+    size_t depth = stack.size() - 1;
+    if (depth >= size_hints.size())
+        size_hints.resize(depth + 1);
+    size_hints[depth] = std::min(n, max_size_hint);
+}
+
+void TreeBuilder::on_list_begin()
+{
+    MList l;
+    stack.push_back({l, {}});
+    if (size_t n = size_hint())
+        (*stack.back().value.m_list())->reserve(n);
+}
+
+void TreeBuilder::on_map_begin()
+{
+    MMap m;
+    stack.push_back({m, {}});
+    if (size_t n = size_hint())
+        (*stack.back().value.m_map())->reserve(n);
+}
+
+void TreeBuilder::on_list_end()
+{
+    set_size_hint((*stack.back().value.m_list())->size());
+    MValue m = std::move(stack.back().value);
+    stack.pop_back();
+    add(std::move(m));
+}
+
+void TreeBuilder::on_map_end()
+{
+    set_size_hint((*stack.back().value.m_map())->size());
+    MValue m = std::move(stack.back().value);
+    stack.pop_back();
+    add(std::move(m));
+}
+
+void TreeBuilder::on_macro_def(
+    std::string_view name)
+{
+    macro_name = name;
+    in_macro = true;
+}
+
+void TreeBuilder::on_macro_ref(
+    std::string_view name)
+{
+    if (MValue* m = macro_map.find(name))
+        add(*m);
+    else if (library)
+        add(library->get(name));
+    else
+        add({});
+}
+
 //static method
 std::string Writer::dumpString(
     std::string_view source)
 {
     auto w = Writer();
     w.dump_string(source);
-    return w.buffer;
+    return std::string{w.buffer.view()};
 }
 
+// The serialized forms of the characters which must be escaped in strings
+struct escape_table
+{
+    struct entry
+    {
+        char text[6];
+        unsigned char len; // 0 if the character needs no escape
+    };
+    entry e[256];
+
+    constexpr escape_table()
+        : e{}
+    {
+        const char* hex = "0123456789ABCDEF";
+        for (int ch = 0; ch < 256; ++ch) {
+            if (ch < 32 || ch == 127)
+                e[ch] = {{'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15]}, 6};
+        }
+        e[(unsigned char) '"'] = {{'\\', '"'}, 2};
+        e[(unsigned char) '\\'] = {{'\\', '\\'}, 2};
+        e[(unsigned char) '\n'] = {{'\\', 'n'}, 2};
+        e[(unsigned char) '\t'] = {{'\\', 't'}, 2};
+        e[(unsigned char) '\b'] = {{'\\', 'b'}, 2};
+        e[(unsigned char) '\f'] = {{'\\', 'f'}, 2};
+        e[(unsigned char) '\r'] = {{'\\', 'r'}, 2};
+    }
+};
+
+constexpr escape_table escapes;
+
+// Runs of characters which need no escaping are found by `find_escape`
+// and copied in one step.
 void Writer::dump_string(
     std::string_view source)
 {
     add('"');
-    for (unsigned char ch : source) {
-        switch (ch) {
-        case '"':
-            add('\\');
-            add('"');
-            break;
-        case '\n':
-            add('\\');
-            add('n');
-            break;
-        case '\t':
-            add('\\');
-            add('t');
-            break;
-        case '\b':
-            add('\\');
-            add('b');
-            break;
-        case '\f':
-            add('\\');
-            add('f');
-            break;
-        case '\r':
-            add('\\');
-            add('r');
-            break;
-        case '\\':
-            add('\\');
-            add('\\');
-            break;
-        case 127:
-            add('\\');
-            add('u');
-            add('0');
-            add('0');
-            add('7');
-            add('F');
+    size_t start = 0;
+    while (true) {
+        size_t i = find_escape(source, start);
+        sink->write(source.substr(start, i - start));
+        if (i == source.size())
             break;
-        default:
-            if (ch >= 32) {
-                add(ch);
-            } else {
-                add('\\');
-                add('u');
-                add('0');
-                add('0');
-                if (ch >= 16) {
-                    add('1');
-                    ch -= 16;
-                } else
-                    add('0');
-                if (ch >= 10)
-                    add('A' + ch - 10);
-                else
-                    add('0' + ch);
-            }
-        }
+        auto& esc = escapes.e[(unsigned char) source[i]];
+        sink->write({esc.text, esc.len});
+        start = i + 1;
     }
     add('"');
 }
 
 void Writer::dump_pad()
 {
+    static const std::string spaces(64, ' ');
     if (depth >= 0) {
         add('\n');
-        for (int i = 0; i < depth * indent; ++i)
-            add(' ');
+        size_t n = depth * indent;
+        for (; n > spaces.size(); n -= spaces.size())
+            sink->write(spaces);
+        sink->write(std::string_view{spaces}.substr(0, n));
     }
 }
 
@@ -643,12 +799,12 @@ void Writer::dump_list(
         if (depth >= 0)
             ++depth;
         for (int i = 0; i < len; ++i) {
+            if (i != 0)
+                add(',');
             dump_pad();
             dump_value(source.get(i));
-            add(',');
         }
         depth = d;
-        pop();
         dump_pad();
     }
     add(']');
@@ -664,6 +820,8 @@ void Writer::dump_map(
         if (depth >= 0)
             ++depth;
         for (int i = 0; i < len; ++i) {
+            if (i != 0)
+                add(',');
             dump_pad();
             MPair& mp = source.get_pair(i);
             dump_string(mp.first);
@@ -671,10 +829,8 @@ void Writer::dump_map(
             if (depth >= 0)
                 add(' ');
             dump_value(mp.second);
-            add(',');
         }
         depth = d;
-        pop();
         dump_pad();
     }
     add('}');
@@ -700,7 +856,7 @@ void Writer::dump_value(
 
 std::string_view Writer::dump()
 {
-    return buffer;
+    return buffer.view();
 }
 
 const char* Writer::dump_c()
@@ -708,8 +864,8 @@ const char* Writer::dump_c()
     return buffer.c_str();
 }
 
-Writer::Writer(
-    MValue& data, int pretty)
+void Writer::set_pretty(
+    int pretty)
 {
     depth = -1;
     if (pretty >= 0) {
@@ -717,75 +873,361 @@ Writer::Writer(
         if (pretty != 0)
             indent = pretty;
     }
+}
+
+Writer::Writer(
+    MValue& data, int pretty)
+    : sink{&buffer}
+{
+    set_pretty(pretty);
+    dump_value(data);
+}
+
+Writer::Writer(
+    MValue& data, Sink& out, int pretty)
+    : sink{&out}
+{
+    set_pretty(pretty);
     dump_value(data);
+    sink->flush();
+}
+
+Writer::Writer(
+    Sink& out, int pretty)
+    : sink{&out}
+{
+    set_pretty(pretty);
+}
+
+// Write the separator and indentation before a list element or map key,
+// and any pending comment.
+void Writer::begin_item()
+{
+    if (levels.empty()) {
+        if (!pending_comment.empty())
+            write_comment();
+        return;
+    }
+    level& l = levels.back();
+    if (l.in_map) {
+        if (!after_key)
+            throw MinionError("Writer: map value without a key");
+        after_key = false;
+        return;
+    }
+    if (l.count++ != 0)
+        add(',');
+    dump_pad();
+    if (!pending_comment.empty())
+        write_comment();
+}
+
+void Writer::end_item()
+{
+    after_key = false;
+    if (levels.empty() && in_macro) {
+        add(',');
+        dump_pad();
+        in_macro = false;
+    }
+}
+
+void Writer::write_comment()
+{
+    sink->write("#[ ");
+    sink->write(pending_comment);
+    sink->write(" ]#");
+    pending_comment.clear();
+    if (depth >= 0)
+        dump_pad();
+    else
+        add(' ');
+}
+
+void Writer::begin_list()
+{
+    begin_item();
+    add('[');
+    levels.push_back({false, 0});
+    if (depth >= 0)
+        ++depth;
+}
+
+void Writer::begin_map()
+{
+    begin_item();
+    add('{');
+    levels.push_back({true, 0});
+    if (depth >= 0)
+        ++depth;
+}
+
+void Writer::end_container(
+    bool in_map)
+{
+    if (levels.empty() || levels.back().in_map != in_map || after_key)
+        throw MinionError(in_map ? "Writer: unexpected end of map" : "Writer: unexpected end of list");
+    size_t n = levels.back().count;
+    levels.pop_back();
+    if (depth >= 0)
+        --depth;
+    if (n != 0)
+        dump_pad();
+    add(in_map ? '}' : ']');
+    end_item();
+}
+
+void Writer::end_list()
+{
+    end_container(false);
+}
+
+void Writer::end_map()
+{
+    end_container(true);
+}
+
+void Writer::key(
+    std::string_view k)
+{
+    if (levels.empty() || !levels.back().in_map || after_key)
+        throw MinionError("Writer: unexpected map key");
+    if (levels.back().count++ != 0)
+        add(',');
+    dump_pad();
+    if (!pending_comment.empty())
+        write_comment();
+    dump_string(k);
+    add(':');
+    if (depth >= 0)
+        add(' ');
+    after_key = true;
+}
+
+void Writer::string(
+    std::string_view s)
+{
+    begin_item();
+    dump_string(s);
+    end_item();
+}
+
+void Writer::value(
+    MValue& m)
+{
+    begin_item();
+    dump_value(m);
+    end_item();
+}
+
+void Writer::macro_def(
+    std::string_view name)
+{
+    if (!levels.empty() || in_macro)
+        throw MinionError("Writer: macro definition not at top level");
+    begin_item();
+    sink->write(name);
+    add(':');
+    if (depth >= 0)
+        add(' ');
+    in_macro = true;
+}
+
+void Writer::macro_ref(
+    std::string_view name)
+{
+    begin_item();
+    sink->write(name);
+    end_item();
+}
+
+void Writer::comment(
+    std::string_view text)
+{
+    pending_comment = text;
+}
+
+void Writer::finish()
+{
+    if (depth >= 0)
+        add('\n');
+    sink->flush();
+}
+
+MString* MList::string_at(
+    size_t index)
+{
+    if (auto ms = get(index).m_string())
+        return ms->get();
+    std::string msg{"List: expecting string at index: "};
+    throw MinionError(msg.append(std::to_string(index)));
+}
+
+void MList::conversion_error(
+    conversion c, std::string_view s, const char* what, size_t index)
+{
+    throw MinionError(conversion_message(c, s, what)
+                          .append("List, seeking ")
+                          .append(what)
+                          .append(" value at index: ")
+                          .append(std::to_string(index)));
+}
+
+bool MList::get_string(
+    size_t index, std::string_view& s)
+{
+    if (index >= size())
+        return false; // out of range
+    s = *string_at(index);
+    return true;
 }
 
 bool MList::get_string(
     size_t index, std::string& s)
 {
-    if (index < size()) {
-        MValue m = get(index);
-        if (auto ms = m.m_string()) {
-            s = **ms;
-            return true;
-        }
-        std::string msg{"List: expecting string at index: "};
-        throw MinionError(msg.append(std::to_string(index)));
-    }
-    return false; // out of range
+    std::string_view v;
+    if (!get_string(index, v))
+        return false;
+    s = v;
+    return true;
 }
 
 bool MList::get_int(
     size_t index, int& i)
 {
-    std::string s;
-    if (!get_string(index, s))
-        return false; // out of range
-    std::string msg{"List, seeking integer value at index: "};
-    i = string2int(s, msg.append(std::to_string(index)));
-    return true;
+    return get(index, i);
+}
+
+MValue* MMap::find(
+    std::string_view key)
+{
+    int i = search(key);
+    if (i < 0)
+        return nullptr;
+    return &(*this)[i].second;
+}
+
+void MMap::append(
+    MMap& other)
+{
+    reserve(size() + other.size());
+    for (auto& mp : static_cast<std::vector<MPair>&>(other))
+        emplace_back(std::move(mp));
+    other.clear();
 }
 
 MValue MMap::get(
     std::string_view key)
 {
-    for (auto& mp : *this) {
-        if (mp.first == key)
-            return mp.second;
-    }
+    if (auto m = find(key))
+        return *m;
     return {};
 }
 
+MString* MMap::string_at(
+    std::string_view key)
+{
+    MValue* m = find(key);
+    if (!m || m->is_null())
+        return nullptr;
+    if (auto ms = m->m_string())
+        return ms->get();
+    std::string msg{"Map: value not string for key: "};
+    throw MinionError(msg.append(key));
+}
+
+void MMap::conversion_error(
+    conversion c, std::string_view s, const char* what, std::string_view key)
+{
+    throw MinionError(conversion_message(c, s, what)
+                          .append("Map, seeking ")
+                          .append(what)
+                          .append(" value at key: ")
+                          .append(key));
+}
+
+bool MMap::get_string(
+    std::string_view key, std::string_view& s)
+{
+    MString* ms = string_at(key);
+    if (!ms)
+        return false;
+    s = *ms;
+    return true;
+}
+
 bool MMap::get_string(
     std::string_view key, std::string& s)
 {
-    MValue m = get(key);
-    if (m.is_null())
+    std::string_view v;
+    if (!get_string(key, v))
         return false;
-    if (auto ms = m.m_string()) {
-        s = **ms;
-        return true;
-    }
-    std::string msg{"Map: value not string for key: "};
-    throw MinionError(msg.append(key));
+    s = v;
+    return true;
 }
 
 bool MMap::get_int(
     std::string_view key, int& i)
 {
-    std::string s;
-    if (!get_string(key, s))
-        return false;
-    std::string msg{"Map, seeking integer value at key: "};
-    i = string2int(s, msg.append(key));
-    return true;
+    return get(key, i);
+}
+
+void MapIndex::sync(
+    const std::vector<MPair>& pairs)
+{
+    size_t n = pairs.size();
+    if (n < n_indexed || n * 2 > slots.size()) {
+        // (Re)build the table, keeping it at most half full
+        size_t capacity = 64;
+        while (capacity < n * 2)
+            capacity *= 2;
+        slots.assign(capacity, {0, 0});
+        n_indexed = 0;
+    }
+    size_t mask = slots.size() - 1;
+    for (; n_indexed < n; ++n_indexed) {
+        std::string_view key = pairs[n_indexed].first;
+        size_t h = std::hash<std::string_view>{}(key);
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            slot& s = slots[i];
+            if (s.pos == 0) {
+                s = {uint32_t(h), uint32_t(n_indexed + 1)};
+                break;
+            }
+            if (s.hash == uint32_t(h) && pairs[s.pos - 1].first == key)
+                break; // a repeated key, the first entry is retained
+        }
+    }
+}
+
+int MapIndex::find(
+    const std::vector<MPair>& pairs, std::string_view key) const
+{
+    if (slots.empty()) {
+        int i = 0;
+        for (auto& mp : pairs) {
+            if (mp.first == key)
+                return i;
+            ++i;
+        }
+        return -1;
+    }
+    size_t h = std::hash<std::string_view>{}(key);
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        const slot& s = slots[i];
+        if (s.pos == 0)
+            return -1;
+        if (s.hash == uint32_t(h) && pairs[s.pos - 1].first == key)
+            return s.pos - 1;
+    }
 }
 
 MValue::MValue(
     std::initializer_list<MValue> items)
-    : _MV{std::make_shared<MList>()}
+    : _MV{make_mptr<MList>()}
 {
-    auto p = std::get_if<std::shared_ptr<MList>>(this)->get();
+    auto p = std::get_if<mptr<MList>>(this)->get();
     for (const auto& item : items) {
         p->emplace_back(item);
     }
@@ -1,6 +1,10 @@
 #ifndef MINION_H
 #define MINION_H
 
+#include "convert.h"
+#include "scanner.h"
+#include "sink.h"
+#include <cstdint>
 #include <memory>
 #include <stdexcept>
 #include <variant>
@@ -38,12 +42,92 @@ struct MError
 };
 
 class Reader;
+class ReadContext;
+class MacroLibrary;
+struct LazySource;
+struct LazyContent;
 
-using _MV = std::variant<std::monostate,
-                         std::shared_ptr<MString>,
-                         std::shared_ptr<MList>,
-                         std::shared_ptr<MMap>,
-                         std::shared_ptr<MError>>;
+#ifdef MINION_INTRUSIVE_REFCOUNT
+
+/* Reference-counted pointer for documents used by a single thread only.
+ * The count is held in the same allocation as the object and is not
+ * atomic, so that copying an `MValue` is cheap. Values must then not be
+ * shared between threads (`Reader::read_parallel` reads sequentially).
+ */
+template<typename T>
+class mptr
+{
+    struct node
+    {
+        T value;
+        uint32_t refs;
+    };
+    node* p{nullptr};
+
+public:
+    mptr() = default;
+    mptr(
+        const mptr& other)
+        : p{other.p}
+    {
+        if (p)
+            ++p->refs;
+    }
+    mptr(
+        mptr&& other) noexcept
+        : p{other.p}
+    {
+        other.p = nullptr;
+    }
+    mptr& operator=(
+        mptr other) noexcept
+    {
+        std::swap(p, other.p);
+        return *this;
+    }
+    ~mptr()
+    {
+        if (p && --p->refs == 0)
+            delete p;
+    }
+
+    T& operator*() const { return p->value; }
+    T* operator->() const { return &p->value; }
+    T* get() const { return p ? &p->value : nullptr; }
+    explicit operator bool() const { return p != nullptr; }
+
+    template<typename... Args>
+    static mptr make(
+        Args&&... args)
+    {
+        mptr m;
+        m.p = new node{T(std::forward<Args>(args)...), 1};
+        return m;
+    }
+};
+
+template<typename T, typename... Args>
+mptr<T> make_mptr(
+    Args&&... args)
+{
+    return mptr<T>::make(std::forward<Args>(args)...);
+}
+
+#else
+
+template<typename T>
+using mptr = std::shared_ptr<T>;
+
+template<typename T, typename... Args>
+mptr<T> make_mptr(
+    Args&&... args)
+{
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
+
+using _MV = std::variant<std::monostate, mptr<MString>, mptr<MList>, mptr<MMap>, mptr<MError>>;
 
 class MValue : _MV
 {
@@ -53,27 +137,31 @@ public:
     {}
     MValue(
         MinionError& e)
-        : _MV{std::make_shared<MError>(e)}
+        : _MV{make_mptr<MError>(e)}
     {}
     MValue(
         MString& s)
-        : _MV{std::make_shared<MString>(s)}
+        : _MV{make_mptr<MString>(s)}
     {}
     MValue(
         std::string s)
-        : _MV{std::make_shared<MString>(s)}
+        : _MV{make_mptr<MString>(std::move(s))}
+    {}
+    MValue(
+        std::string_view s)
+        : _MV{make_mptr<MString>(std::string{s})}
     {}
     MValue(
         const char* s)
-        : _MV{std::make_shared<MString>(s)}
+        : _MV{make_mptr<MString>(s)}
     {}
     MValue(
         MList& l)
-        : _MV{std::make_shared<MList>(l)}
+        : _MV{make_mptr<MList>(l)}
     {}
     MValue(
         MMap& m)
-        : _MV{std::make_shared<MMap>(m)}
+        : _MV{make_mptr<MMap>(m)}
     {}
     // Using initializer_lists for list
     MValue(std::initializer_list<MValue> items);
@@ -83,12 +171,14 @@ public:
     int type() { return this->index(); }
     bool is_null() { return this->index() == 0; }
 
-    std::shared_ptr<MString>* m_string() { return std::get_if<std::shared_ptr<MString>>(this); }
-    std::shared_ptr<MList>* m_list() { return std::get_if<std::shared_ptr<MList>>(this); }
-    std::shared_ptr<MMap>* m_map() { return std::get_if<std::shared_ptr<MMap>>(this); }
+    mptr<MString>* m_string() { return std::get_if<mptr<MString>>(this); }
+    // The contents of a list or map in a lazily read document are read
+    // when it is first accessed (which may throw a `MinionError`)
+    mptr<MList>* m_list();
+    mptr<MMap>* m_map();
     const char* error_message()
     {
-        auto m = std::get_if<std::shared_ptr<MError>>(this);
+        auto m = std::get_if<mptr<MError>>(this);
         if (m)
             return (*m)->message.c_str();
         return nullptr;
@@ -96,37 +186,212 @@ public:
 };
 
 class MString : public std::string
-{};
+{
+public:
+#ifdef MINION_CONVERSION_CACHE
+    conversion_cache cache;
+
+    template<typename T>
+    conversion to(
+        T& value)
+    {
+        return convert(*this, value, cache);
+    }
+#else
+    template<typename T>
+    conversion to(
+        T& value)
+    {
+        return convert(*this, value);
+    }
+#endif
+};
+
+// The start of the message for a failed conversion, up to "context: "
+std::string conversion_message(conversion c, std::string_view s, const char* what);
 
 class MList : public std::vector<MValue>
 {
+    friend MValue;
+    friend Reader;
+
+    std::shared_ptr<LazyContent> lazy; // contents not yet read
+    void expand();
+
+    MString* string_at(size_t index);
+    [[noreturn]] void conversion_error(
+        conversion c, std::string_view s, const char* what, size_t index);
+
 public:
     MValue& get(
         size_t index)
     {
         return this->at(index);
     }
+    // The `std::string_view` form refers to the string in the list
+    bool get_string(size_t index, std::string_view& s);
     bool get_string(size_t index, std::string& s);
     bool get_int(size_t index, int& i);
+
+    // Get a value converted to an integer, floating-point, boolean or
+    // `std::chrono::duration` type (see convert.h). Return false if the
+    // index is out of range, throw a `MinionError` if the value is not a
+    // string or can't be converted.
+    template<typename T>
+    bool get(
+        size_t index, T& value)
+    {
+        if (index >= size())
+            return false;
+        MString* ms = string_at(index);
+        if (conversion c = ms->to(value); c != conversion::ok)
+            conversion_error(c, *ms, conversion_name<T>(), index);
+        return true;
+    }
 };
 
 using MPair = std::pair<std::string, MValue>;
 
-class MMap : public std::vector<MPair>
+/* Hash index for the keys of a map. A map retains its input order by
+ * holding its entries in a vector of key/value pairs, which is searched
+ * linearly while it is small. Once a map has more than `threshold`
+ * entries, an open-addressing hash table of the positions of its pairs
+ * is kept, which is extended as pairs are added (`sync`). A search thus
+ * only reads the map, so that a map which is no longer changed can be
+ * searched by several threads at once.
+ * If a key occurs more than once, the first entry is found.
+ */
+class MapIndex
 {
+    struct slot
+    {
+        uint32_t hash;
+        uint32_t pos; // 1 + index of the pair, 0 for an empty slot
+    };
+    std::vector<slot> slots;
+    size_t n_indexed{0};
+
+public:
+    static constexpr size_t threshold = 16;
+
+    // Index the pairs added since the last call
+    void sync(const std::vector<MPair>& pairs);
+    // Return the index of the pair with the given key, or -1 if there
+    // is none.
+    int find(const std::vector<MPair>& pairs, std::string_view key) const;
+    void clear()
+    {
+        slots.clear();
+        n_indexed = 0;
+    }
+};
+
+/* The pairs of a map can be read (also by iterating over the map) and
+ * their values changed, but pairs can only be added at the end, or all
+ * removed, so that the key index is kept up to date. The keys must not
+ * be changed in place.
+ */
+class MMap : private std::vector<MPair>
+{
+    friend MValue;
     friend Reader;
 
+    MapIndex index;
+    std::shared_ptr<LazyContent> lazy; // contents not yet read
+    void expand();
+
+    MString* string_at(std::string_view key);
+    [[noreturn]] void conversion_error(
+        conversion c, std::string_view s, const char* what, std::string_view key);
+
 public:
+    using std::vector<MPair>::const_iterator;
+    using std::vector<MPair>::size;
+    using std::vector<MPair>::empty;
+    using std::vector<MPair>::reserve;
+
+    const_iterator begin() const { return std::vector<MPair>::begin(); }
+    const_iterator end() const { return std::vector<MPair>::end(); }
+
+    template<typename... Args>
+    void emplace_back(
+        Args&&... args)
+    {
+        std::vector<MPair>::emplace_back(std::forward<Args>(args)...);
+        if (size() > MapIndex::threshold)
+            index.sync(*this);
+    }
+
+    // Move the pairs of another map to the end of this one, leaving that
+    // one empty
+    void append(MMap& other);
+
+    // Exchange the contents with those of another map, with their index
+    void swap(
+        MMap& other)
+    {
+        std::vector<MPair>::swap(other);
+        std::swap(index, other.index);
+    }
+
     MValue get(std::string_view key);
+    // Return a pointer to the value for the given key (not a copy), or
+    // null if there is none.
+    MValue* find(std::string_view key);
+    int search(
+        std::string_view key) const
+    {
+        return index.find(*this, key);
+    }
     MPair& get_pair(
         size_t index)
     {
         return this->at(index);
     }
+    // The `std::string_view` form refers to the string in the map
+    bool get_string(std::string_view key, std::string_view& s);
     bool get_string(std::string_view key, std::string& s);
     bool get_int(std::string_view key, int& i);
+
+    // Get a value converted to an integer, floating-point, boolean or
+    // `std::chrono::duration` type (see convert.h). Return false if the
+    // key is not present, throw a `MinionError` if the value is not a
+    // string or can't be converted.
+    template<typename T>
+    bool get(
+        std::string_view key, T& value)
+    {
+        MString* ms = string_at(key);
+        if (!ms)
+            return false;
+        if (conversion c = ms->to(value); c != conversion::ok)
+            conversion_error(c, *ms, conversion_name<T>(), key);
+        return true;
+    }
+
+    void clear()
+    {
+        std::vector<MPair>::clear();
+        index.clear();
+    }
 };
 
+inline mptr<MList>* MValue::m_list()
+{
+    auto p = std::get_if<mptr<MList>>(this);
+    if (p && (*p)->lazy)
+        (*p)->expand();
+    return p;
+}
+
+inline mptr<MMap>* MValue::m_map()
+{
+    auto p = std::get_if<mptr<MMap>>(this);
+    if (p && (*p)->lazy)
+        (*p)->expand();
+    return p;
+}
+
 // Used for recording read-position in input text
 struct position
 {
@@ -134,16 +399,173 @@ struct position
     size_t byte_ix;
 };
 
-class Reader
+// The lexical tokens delivered by the tokenizer
+enum tokens {
+    Token_End = 0,
+    Token_StartList,
+    Token_EndList,
+    Token_StartMap,
+    Token_EndMap,
+    Token_Comma,
+    Token_Colon,
+    Token_Macro,
+    Token_String
+};
+
+/* Event ("SAX") interface to the reader. The reader calls these
+ * functions as it reads the items, in input order, without building any
+ * data structures itself. The strings passed are valid only during the
+ * call. A map key (`on_key`) is followed by the events for its value.
+ * A macro definition (`on_macro_def`) is followed by the events for its
+ * value, a macro reference (`on_macro_ref`) stands for a complete value;
+ * the reader checks that the macro has been defined.
+ * To stop reading, a handler can throw a `MinionError`, whose message is
+ * then returned as the result.
+ */
+class Handler
 {
+    friend class Reader;
+    Reader* reader{nullptr};
+
+protected:
+    // The position in the input just after the current item, as used in
+    // the reader's error messages
+    position here();
+    // The index in the input of the first byte of the current item (for
+    // a `StreamReader`, in its buffer)
+    size_t offset();
+
+public:
+    virtual ~Handler() = default;
+
+    virtual void on_string(std::string_view) {}
+    virtual void on_list_begin() {}
+    virtual void on_list_end() {}
+    virtual void on_map_begin() {}
+    virtual void on_map_end() {}
+    virtual void on_key(std::string_view) {}
+    virtual void on_macro_def(std::string_view) {}
+    virtual void on_macro_ref(std::string_view) {}
+};
+
+// The handler used by `Reader::read` to build an `MValue` tree
+class TreeBuilder : public Handler
+{
+    friend class Reader;
+    friend class IndexedFile;
+    friend ReadContext;
+    friend MacroLibrary;
+
+    struct frame
+    {
+        MValue value; // open list or map
+        std::string key;
+    };
+    std::vector<frame> stack;
     MMap macro_map;
-    MValue get_macro(std::string_view s);
+    std::string macro_name;
+    bool in_macro{false};
+    MacroLibrary* library{nullptr}; // macros defined before the input
+
+    // The number of elements of the list or map most recently finished at
+    // each depth, for which space is reserved in the next one
+    std::vector<uint32_t> size_hints;
+    static constexpr size_t max_size_hint = 64;
+    size_t size_hint();
+    void set_size_hint(size_t n);
+
+protected:
+    void add(MValue m);
+
+public:
+    MValue result;
+
+    void on_string(std::string_view s) override { add(s); }
+    void on_list_begin() override;
+    void on_list_end() override;
+    void on_map_begin() override;
+    void on_map_end() override;
+    void on_key(
+        std::string_view key) override
+    {
+        stack.back().key = key;
+    }
+    void on_macro_def(std::string_view name) override;
+    void on_macro_ref(std::string_view name) override;
+
+    // The value of a macro which has been defined
+    MValue macro(
+        std::string_view name)
+    {
+        return macro_map.get(name);
+    }
+};
+
+// The extent of a list or map in the input, with the line information
+// at its start and end, recorded for lazy reading
+struct lazy_span
+{
+    size_t start; // the position of '[' or '{'
+    size_t end;   // the position following ']' or '}'
+    size_t line_index;
+    size_t line_start;
+    size_t end_line_index;
+    size_t end_line_start;
+};
+
+/* A set of macros read from a document which contains only macro
+ * definitions (e.g. a preamble shared by many documents), which can then
+ * be used by other documents (`Reader::read`) without being read again.
+ * The values are shared with all the documents which use them, so they
+ * must not be modified. Neither lookups in the library nor searches in
+ * the maps of its values (whose key indexes are built as they are read)
+ * modify it, so it can be used by several threads at once – except in a
+ * build with MINION_INTRUSIVE_REFCOUNT, whose reference counts are not
+ * atomic, or, if its values are read by the typed `get` methods, with
+ * MINION_CONVERSION_CACHE (see convert.h).
+ */
+class MacroLibrary
+{
+    friend Reader;
+    friend TreeBuilder;
+
+    MMap macros;
+
+public:
+    // Read the macro definitions, replacing any read before. The result is
+    // empty, or an error value (the library is then empty).
+    MValue read(std::string_view s);
+
+    size_t size() { return macros.size(); }
+    // The value of a macro (the name includes the initial '&'), empty if
+    // there is no such macro
+    MValue get(std::string_view name) { return macros.get(name); }
+};
+
+class Reader
+{
+    friend class StreamReader;
+    friend class Handler;
+    friend class IndexedFile;
+    friend ReadContext;
+    friend MacroLibrary;
+    friend MList;
+    friend MMap;
+
+    Handler* handler;
+    MMap macro_map; // names of the macros defined so far (no values)
+    MacroLibrary* library{nullptr};
+    void check_macro(std::string_view s);
 
     std::string_view input;
+    Scanner scanner;
     size_t ch_index;
     size_t line_index;
     size_t ch_linestart;
-    std::string ch_buffer; // for reading strings
+    size_t token_start; // index of the first byte of the current token
+    std::string ch_buffer;       // for decoding strings with escapes
+    std::string_view string_item; // the string most recently read
+    bool string_in_input;        // `string_item` refers to the input
 
     std::string error_message;
 
@@ -157,8 +579,12 @@ class Reader
     }
     void error(std::string_view msg);
 
-    MValue get_list();
-    MValue get_map();
+    void init(std::string_view s, Handler& h);
+    int get_macros();
+    void get_list();
+    void get_map();
+    void get_value(int t, std::string_view context);
+    void get_elements(bool in_map, bool last);
 
     void get_string();
     void get_bare_string(char ch);
@@ -167,40 +593,222 @@ class Reader
     int get_token();
     std::string token_text(int token);
 
-    Reader(std::string_view s);
+    // A part of a list or map for parallel reading, with the line
+    // information at its start
+    struct segment
+    {
+        size_t start;
+        size_t end;
+        size_t line_index;
+        size_t line_start;
+    };
+    bool prescan(
+        std::vector<segment>& segments, size_t target, std::vector<lazy_span>* spans = nullptr);
+
+    // Lazy reading: lists and maps within the one being read are not
+    // read, but added as references to their spans
+    std::shared_ptr<LazySource> lazy;
+    void skip_lazy(bool in_map);
+    static MValue read_span(LazyContent& content);
+
+    Reader(std::string_view s, Handler& h, MacroLibrary* lib = nullptr);
+    Reader() = default; // for `StreamReader`, which supplies the input
     MValue result;
+    void read_document(std::string_view s, Handler& h);
 
 public:
     static MValue read(std::string_view s);
+    // Read, passing the items to the given handler. The result is empty,
+    // or an error value.
+    static MValue read(std::string_view s, Handler& h);
+
+    // Read a document which may use the macros of the given library, as
+    // well as its own (which take precedence). The library's values are
+    // shared with the result, not copied. A handler is passed the names of
+    // the library's macros which are used, their values are available
+    // from the library.
+    static MValue read(std::string_view s, MacroLibrary& lib);
+    static MValue read(std::string_view s, MacroLibrary& lib, Handler& h);
+
+    // Read the binary form written by a `BinaryWriter` (binary.h), with
+    // the same results as `read` gives for the text form
+    static MValue read_binary(std::string_view s);
+    static MValue read_binary(std::string_view s, Handler& h);
+
+    // Inputs smaller than this are always read sequentially
+    static constexpr size_t parallel_min_size = 1 << 20;
+    // Read a large list or map (the top-level item) using several threads,
+    // by default as many as there are processors. The result is the same
+    // as that of `read`.
+    static MValue read_parallel(std::string_view s, unsigned n_threads = 0);
+
+    // Read only the top-level list or map, after a quick scan of the whole
+    // input to find the extent of each list and map. The contents of the
+    // others are read when they are first accessed. The input must remain
+    // valid as long as the result is in use. Some errors in the input are
+    // only found – and thrown as a `MinionError` – when the list or map
+    // containing them is accessed. The result must not be accessed by
+    // more than one thread at a time.
+    static MValue read_lazy(std::string_view s);
 };
 
+/* A reader and tree builder which are kept between reads, so that their
+ * buffers (for strings with escapes, macro names and the stack of open
+ * lists and maps) need not be allocated again for each document. The
+ * builder also remembers the sizes of recent lists and maps, reserving
+ * space for that number of elements in the next ones at the same depth.
+ * This matters most when many small documents are read. Each thread has
+ * its own context (`local`), which is used by `Reader::read`. A context
+ * must not be used by more than one thread at a time.
+ */
+class ReadContext
+{
+    Reader reader;
+    TreeBuilder builder;
+    bool busy{false};
+
+public:
+    ReadContext() = default;
+    ReadContext(const ReadContext&) = delete;
+    ReadContext& operator=(const ReadContext&) = delete;
+
+    // As `Reader::read`
+    MValue read(std::string_view s, MacroLibrary* lib = nullptr);
+
+    // The context of the calling thread
+    static ReadContext& local();
+};
+
+/* A push-style reader: the input is supplied in chunks of any size (as
+ * they arrive from a pipe or socket, say), so that the whole document
+ * need never be held in memory. Only an unfinished token and a little
+ * context for error messages are kept between calls, together with the
+ * stack of open lists and maps.
+ * The items are passed to a `Handler`, by default to a `TreeBuilder`, in
+ * which case the result and the error messages are the same as for
+ * `Reader::read`.
+ */
+class StreamReader
+{
+    Reader reader;      // the tokenizer, working on `buffer`
+    TreeBuilder builder; // used if no handler is supplied
+    std::string buffer; // unprocessed input (with a little history)
+    bool finished;      // no more input will come
+    bool done;          // the top-level item is complete, or there was an error
+    MValue result;
+
+    // Resumable search for the end of the next token
+    int scan_state;
+    size_t scan_pos;
+    bool token_ready();
+
+    // Parser state, with a stack of the states enclosing open lists and maps
+    std::vector<int> stack;
+    int state;
+    std::string macro_key;
+
+    void parse();
+    void take_token(int t);
+    bool start_value(int t);
+    void value_done();
+    void end_container();
+    void unexpected(std::string_view msg, int t);
+    void compact();
+
+public:
+    StreamReader();
+    StreamReader(Handler& h);
+    StreamReader(const StreamReader&) = delete;
+    StreamReader& operator=(const StreamReader&) = delete;
+
+    // Add a chunk of input. Return true if the top-level item has been
+    // completed (or an error has been found), `result` is then available.
+    bool feed(std::string_view chunk);
+    // Signal the end of the input and return the result (which may be an
+    // error). Anything but whitespace and comments after the top-level
+    // item is an error. With a handler other than the default, the result
+    // is empty if there was no error.
+    MValue finish();
+
+    bool complete() { return done; }
+    MValue& get_result() { return result; }
+};
+
+/* The serializer. An `MValue` can be written as a whole, or the items
+ * can be passed one by one (`begin_list`, `string`, etc.), which can also
+ * write macros and comments (not valid JSON). By default the output is
+ * collected in a string, but it can also be passed to another `Sink`
+ * (e.g. a file) as it is produced, so that large outputs need neither a
+ * tree nor the whole text to be held in memory.
+ */
 class Writer
 {
     int indent = 2;
     int depth;
-    std::string buffer;
+    StringSink buffer; // the default sink
+    Sink* sink;
+
+    // State of incremental writing
+    struct level
+    {
+        bool in_map;
+        size_t count; // number of elements written
+    };
+    std::vector<level> levels;
+    bool after_key{false};
+    bool in_macro{false}; // writing the value of a macro definition
+    std::string pending_comment;
 
     void add(
         char ch)
     {
-        buffer.push_back(ch);
+        sink->put(ch);
     }
-    void pop() { buffer.pop_back(); }
     void dump_value(MValue& source);
     void dump_string(std::string_view source);
     void dump_list(MList& source);
     void dump_map(MMap& source);
     void dump_pad();
+    void set_pretty(int pretty);
+    void begin_item();
+    void end_item();
+    void write_comment();
+    void end_container(bool in_map);
 
     Writer()
         : depth{0}
+        , sink{&buffer}
     {}
 
 public:
     Writer(MValue& data, int pretty = -1);
+    // Write to the given sink, which is flushed at the end
+    Writer(MValue& data, Sink& out, int pretty = -1);
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    // The output, if the default sink is used
     const char* dump_c();
     std::string_view dump();
 
+    // Incremental writing to the given sink. A map element is written as
+    // a `key` followed by its value. `finish` flushes the sink.
+    Writer(Sink& out, int pretty = -1);
+    void begin_list();
+    void end_list();
+    void begin_map();
+    void end_map();
+    void key(std::string_view k);
+    void string(std::string_view s);
+    void value(MValue& m);
+    // A macro definition, at the top level, is followed by its value.
+    // The names include the initial '&'.
+    void macro_def(std::string_view name);
+    void macro_ref(std::string_view name);
+    // A comment, written before the next item. It should not contain "]#".
+    void comment(std::string_view text);
+    void finish();
+
     static std::string dumpString(std::string_view source);
 };
 
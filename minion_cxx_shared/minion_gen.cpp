@@ -0,0 +1,389 @@
+/* minion_gen: generate synthetic MINION (or JSON) documents for testing
+ * and benchmarking. The output is determined by the seed and the shape
+ * parameters. It is written incrementally (by a `Writer`), so that very
+ * large documents can be produced without holding them in memory.
+ *
+ * The document is a list (or a map, with --top=map) of generated items.
+ * Their number is found first, by generating the document in compact JSON
+ * (without writing it) until this reaches the requested size, so that
+ * the output options (--json, --comments, --pretty) don't change the
+ * data, but only the size of the output. An item
+ * is a string or, if the maximum depth has not been reached, a list or a
+ * map, with up to --fanout elements or --keys keys.
+ * In MINION output, the list is preceded by --macros macro definitions,
+ * and a value is a reference to one of these with the probability
+ * --macro-refs. In JSON output the macro values are written in full
+ * instead of the references (they are generated again from their own
+ * seeds). Comments are only written in MINION output.
+ */
+
+#include "minion.h"
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+using namespace minion;
+
+namespace {
+
+struct parameters
+{
+    uint64_t seed = 1;
+    size_t size = 1 << 20;   // approximate size of the output
+    bool top_map = false;    // the top-level item is a map
+    int depth = 4;           // maximum nesting depth of an item
+    int fanout = 8;          // maximum number of list elements
+    int keys = 8;            // maximum number of map keys
+    size_t strlen_min = 1;   // string lengths are distributed
+    size_t strlen_max = 16;  // logarithmically between these
+    double escapes = 0.01;   // proportion of characters needing an escape
+    double unicode = 0.01;   // proportion of non-ASCII characters
+    double comments = 0.0;   // probability of a comment before an element
+    int macros = 0;          // number of macro definitions
+    double macro_refs = 0.0; // probability of a macro reference as value
+    bool json = false;
+    int pretty = -1;
+};
+
+// Deterministic pseudo-random numbers (splitmix64)
+struct Random
+{
+    uint64_t state;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+    // In the range [0, n)
+    size_t below(
+        size_t n)
+    {
+        return next() % n;
+    }
+    // In the range [0, 1)
+    double real() { return (next() >> 11) * 0x1.0p-53; }
+    bool chance(
+        double p)
+    {
+        return p > 0.0 && real() < p;
+    }
+};
+
+// Write to a file descriptor, counting the bytes. If the file descriptor
+// is negative, the output is only counted.
+class CountingSink : public ChunkedSink
+{
+    int fd;
+    size_t total{0};
+
+    bool output(
+        const char* p, size_t n) override
+    {
+        total += n;
+        while (fd >= 0 && n != 0) {
+            ssize_t k = ::write(fd, p, n);
+            if (k < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += k;
+            n -= k;
+        }
+        return true;
+    }
+
+public:
+    CountingSink(
+        int f)
+        : fd{f}
+    {}
+
+    size_t written() { return total + pending().size(); }
+};
+
+class Generator
+{
+    parameters& par;
+    Writer& w;
+    std::string buffer; // for building strings
+
+    const char* const plain = "abcdefghijklmnopqrstuvwxyz0123456789 ";
+    const char* const special[6] = {"\"", "\\", "\n", "\t", "\x01", "/"};
+    const char* const nonascii[4] = {"é", "ß", "€", "𝄞"};
+
+public:
+    Generator(
+        parameters& p, Writer& writer)
+        : par{p}
+        , w{writer}
+    {}
+
+    void string(
+        Random& r)
+    {
+        double lmin = std::log(double(par.strlen_min));
+        double lmax = std::log(double(par.strlen_max) + 1.0);
+        size_t len = size_t(std::exp(lmin + r.real() * (lmax - lmin)));
+        buffer.clear();
+        for (size_t i = 0; i < len; ++i) {
+            if (r.chance(par.escapes))
+                buffer.append(special[r.below(6)]);
+            else if (r.chance(par.unicode))
+                buffer.append(nonascii[r.below(4)]);
+            else
+                buffer.push_back(plain[r.below(37)]);
+        }
+    }
+
+    // The random numbers are used in the same way for JSON output (which
+    // has no comments), so that the data is the same.
+    void comment(
+        Random& r)
+    {
+        if (r.chance(par.comments)) {
+            std::string c = "comment " + std::to_string(r.below(1000000));
+            if (!par.json)
+                w.comment(c);
+        }
+    }
+
+    // Generate the value of macro `i` (always from its own seed)
+    void macro_value(
+        int i)
+    {
+        Random r{par.seed ^ (uint64_t(i + 1) * 0x2545f4914f6cdd1d)};
+        item(r, par.depth > 2 ? par.depth - 2 : par.depth, false);
+    }
+
+    void item(
+        Random& r, int depth, bool refs = true)
+    {
+        if (refs && par.macros != 0 && r.chance(par.macro_refs)) {
+            int i = r.below(par.macros);
+            if (par.json)
+                macro_value(i);
+            else
+                w.macro_ref("&M" + std::to_string(i));
+            return;
+        }
+        size_t kind = depth > 0 ? r.below(3) : 0;
+        if (kind == 0) {
+            string(r);
+            w.string(buffer);
+        } else if (kind == 1) {
+            w.begin_list();
+            size_t n = r.below(par.fanout + 1);
+            for (size_t i = 0; i < n; ++i) {
+                comment(r);
+                item(r, depth - 1, refs);
+            }
+            w.end_list();
+        } else {
+            w.begin_map();
+            size_t n = r.below(par.keys + 1);
+            for (size_t i = 0; i < n; ++i) {
+                comment(r);
+                // Keys are made unique by their index
+                string(r);
+                buffer.append("_").append(std::to_string(i));
+                w.key(buffer);
+                item(r, depth - 1, refs);
+            }
+            w.end_map();
+        }
+    }
+
+    void top_item(
+        Random& r, size_t i)
+    {
+        comment(r);
+        if (par.top_map)
+            w.key("item_" + std::to_string(i));
+        item(r, par.depth);
+    }
+
+    // The number of top-level items needed for the compact JSON form of
+    // the document to reach the requested size
+    static size_t count_items(
+        parameters par)
+    {
+        par.json = true;
+        CountingSink out(-1);
+        Writer w(out);
+        Generator g(par, w);
+        Random r{par.seed};
+        if (par.top_map)
+            w.begin_map();
+        else
+            w.begin_list();
+        size_t n = 0;
+        while (out.written() < par.size)
+            g.top_item(r, n++);
+        return n;
+    }
+
+    void document(
+        size_t n_items)
+    {
+        if (!par.json) {
+            Random rc{~par.seed}; // for the comments
+            for (int i = 0; i < par.macros; ++i) {
+                comment(rc);
+                w.macro_def("&M" + std::to_string(i));
+                macro_value(i);
+            }
+        }
+        Random r{par.seed};
+        if (par.top_map)
+            w.begin_map();
+        else
+            w.begin_list();
+        for (size_t i = 0; i < n_items; ++i)
+            top_item(r, i);
+        if (par.top_map)
+            w.end_map();
+        else
+            w.end_list();
+        w.finish();
+    }
+};
+
+// Parse a size such as "64K", "16M" or "1G"
+bool parse_size(
+    const char* s, size_t& n)
+{
+    char* end;
+    n = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'K':
+        n <<= 10;
+        ++end;
+        break;
+    case 'M':
+        n <<= 20;
+        ++end;
+        break;
+    case 'G':
+        n <<= 30;
+        ++end;
+        break;
+    }
+    return end != s && *end == 0;
+}
+
+void usage(
+    const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [output file]\n"
+            "  --seed=N         seed for the pseudo-random numbers (1)\n"
+            "  --size=N[K|M|G]  approximate size of the output as compact JSON (1M)\n"
+            "  --top=list|map   type of the top-level item (list)\n"
+            "  --depth=N        maximum nesting depth of the items (4)\n"
+            "  --fanout=N       maximum number of elements in a list (8)\n"
+            "  --keys=N         maximum number of keys in a map (8)\n"
+            "  --strlen=MIN:MAX range of string lengths (1:16)\n"
+            "  --escapes=P      proportion of characters needing escapes (0.01)\n"
+            "  --unicode=P      proportion of non-ASCII characters (0.01)\n"
+            "  --comments=P     probability of a comment before an element (0)\n"
+            "  --macros=N       number of macro definitions (0)\n"
+            "  --macro-refs=P   probability of a macro reference as a value (0)\n"
+            "  --json           write JSON (no comments, macros expanded)\n"
+            "  --pretty=N       indent by N spaces (compact output by default)\n",
+            prog);
+}
+
+bool parse_args(
+    int argc, char** argv, parameters& par, const char*& output)
+{
+    output = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string a{argv[i]};
+        if (a.compare(0, 2, "--") != 0) {
+            if (output)
+                return false;
+            output = argv[i];
+            continue;
+        }
+        auto eq = a.find('=');
+        std::string name = a.substr(2, eq - 2);
+        const char* v = (eq == std::string::npos) ? nullptr : argv[i] + eq + 1;
+        if (name == "json") {
+            par.json = true;
+            continue;
+        }
+        if (!v)
+            return false;
+        if (name == "seed")
+            par.seed = strtoull(v, nullptr, 0);
+        else if (name == "size") {
+            if (!parse_size(v, par.size))
+                return false;
+        } else if (name == "top") {
+            if (strcmp(v, "map") == 0)
+                par.top_map = true;
+            else if (strcmp(v, "list") != 0)
+                return false;
+        } else if (name == "depth")
+            par.depth = atoi(v);
+        else if (name == "fanout")
+            par.fanout = atoi(v);
+        else if (name == "keys")
+            par.keys = atoi(v);
+        else if (name == "strlen") {
+            if (sscanf(v, "%zu:%zu", &par.strlen_min, &par.strlen_max) != 2 || par.strlen_min == 0
+                || par.strlen_max < par.strlen_min)
+                return false;
+        } else if (name == "escapes")
+            par.escapes = atof(v);
+        else if (name == "unicode")
+            par.unicode = atof(v);
+        else if (name == "comments")
+            par.comments = atof(v);
+        else if (name == "macros")
+            par.macros = atoi(v);
+        else if (name == "macro-refs")
+            par.macro_refs = atof(v);
+        else if (name == "pretty")
+            par.pretty = atoi(v);
+        else
+            return false;
+    }
+    return par.depth >= 0 && par.fanout >= 0 && par.keys >= 0 && par.macros >= 0;
+}
+
+} // namespace
+
+int main(
+    int argc, char** argv)
+{
+    parameters par;
+    const char* output;
+    if (!parse_args(argc, argv, par, output)) {
+        usage(argv[0]);
+        return 1;
+    }
+    int fd = 1;
+    if (output && (fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(output);
+        return 1;
+    }
+    size_t n_items = Generator::count_items(par);
+    CountingSink out(fd);
+    Writer w(out, par.pretty);
+    Generator(par, w).document(n_items);
+    if (!out.ok() || (output && close(fd) != 0)) {
+        perror(output ? output : "stdout");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include "minion.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace minion {
+
+/* Parallel reading of a large top-level list or map.
+ * The macro definitions are read first, as usual. Then a quick scan of
+ * the list or map (`prescan`), which only follows nesting, strings and
+ * comments, divides its contents into segments at top-level commas. The
+ * segments are read by a number of threads, each into its own list or
+ * map, which are finally joined in input order. Each segment is read by
+ * a `Reader` on the input truncated at the end of the segment, starting
+ * with the line information found by the scan, so that positions in
+ * error messages are the same as for a sequential read.
+ * If anything is not as expected – including any error in the input –
+ * the input is simply read again sequentially, to report the error in
+ * the normal way.
+ */
+
+// Minimum size of a segment
+const size_t min_segment_size = 64 * 1024;
+// Segments per thread, for load balancing
+const size_t thread_segments = 8;
+
+// Find the end of the list or map which has just been opened, dividing
+// its contents into segments of at least `target` bytes at top-level
+// commas. If `spans` is given, the extent of each list and map within it
+// is added there, in input order. On success `ch_index` (etc.) refer to
+// the position following the list or map. Return false if the input is
+// not as expected.
+bool Reader::prescan(
+    std::vector<segment>& segments, size_t target, std::vector<lazy_span>* spans)
+{
+    const size_t n = input.size();
+    size_t p = ch_index;
+    segment seg{p, 0, line_index, ch_linestart};
+    int depth = 1;
+    std::vector<size_t> open; // the unclosed spans
+    unsigned char ch;
+    while (true) {
+        p = scanner.skip_space(p, line_index, ch_linestart);
+        if (p >= n)
+            return false;
+        ch = input[p];
+        switch (ch) {
+        case '[':
+        case '{':
+            if (spans) {
+                open.push_back(spans->size());
+                spans->push_back({p, 0, line_index, ch_linestart, 0, 0});
+            }
+            ++depth;
+            ++p;
+            break;
+        case ']':
+        case '}':
+            if (--depth == 0) {
+                seg.end = p;
+                segments.push_back(seg);
+                ch_index = p + 1;
+                return true;
+            }
+            ++p;
+            if (spans) {
+                lazy_span& sp = (*spans)[open.back()];
+                open.pop_back();
+                sp.end = p;
+                sp.end_line_index = line_index;
+                sp.end_line_start = ch_linestart;
+            }
+            break;
+        case ',':
+            if (depth == 1 && p - seg.start >= target) {
+                seg.end = p;
+                segments.push_back(seg);
+                seg = {p + 1, 0, line_index, ch_linestart};
+            }
+            ++p;
+            break;
+        case ':':
+            ++p;
+            break;
+        case '"':
+            // Delimited string
+            ++p;
+            while (true) {
+                p = scanner.find(p, C_Quote | C_Control);
+                if (p + 1 >= n)
+                    return false;
+                ch = input[p++];
+                if (ch == '"')
+                    break;
+                if (ch != '\\')
+                    return false; // control character
+                if (input[p++] != '[')
+                    continue; // escaped character
+                // Embedded comment, to "\]"
+                while (true) {
+                    p = scanner.find(p, C_Quote | C_Control);
+                    if (p + 1 >= n)
+                        return false;
+                    ch = input[p++];
+                    if (ch == '\\') {
+                        if (input[p] == ']') {
+                            ++p;
+                            break;
+                        }
+                    } else if (ch == '\n') {
+                        ++line_index;
+                        ch_linestart = p;
+                    } else if (ch != '"' && ch != '\t' && ch != '\r')
+                        return false;
+                }
+            }
+            break;
+        case '#':
+            if (p + 1 < n && input[p + 1] == '[') {
+                // Extended comment, to "]#"
+                p += 2;
+                while (true) {
+                    p = scanner.find(p, C_Structural | C_Control);
+                    if (p + 1 >= n)
+                        return false;
+                    ch = input[p++];
+                    if (ch == ']') {
+                        if (input[p] == '#') {
+                            ++p;
+                            break;
+                        }
+                    } else if (ch == '\n') {
+                        ++line_index;
+                        ch_linestart = p;
+                    } else if ((ch < 32 && ch != '\t' && ch != '\r') || ch == 127)
+                        return false;
+                }
+            } else {
+                // Comment to the end of the line, which is then skipped
+                // as whitespace
+                while (true) {
+                    p = scanner.find(p + 1, C_Control);
+                    if (p >= n || input[p] == '\n')
+                        break;
+                    if (input[p] != '\t' && input[p] != '\r')
+                        return false;
+                }
+            }
+            break;
+        default:
+            if (ch < 32 || ch == 127)
+                return false;
+            // Undelimited string or macro name
+            while (true) {
+                p = scanner.find(p + 1, C_Space | C_Control | C_Quote | C_Structural);
+                if (p >= n)
+                    return false;
+                ch = input[p];
+                if (ch != '#' && ch != '&')
+                    break;
+            }
+            if (ch == '"' || ch == '\\' || ch == '[' || ch == '{')
+                return false;
+        }
+    }
+}
+
+// Read the elements of a list or map from `ch_index` to the end of the
+// input, which is the end of a segment. Only the last segment may end
+// with a comma.
+void Reader::get_elements(
+    bool in_map, bool last)
+{
+    if (in_map)
+        handler->on_map_begin();
+    else
+        handler->on_list_begin();
+    while (true) {
+        auto t = get_token();
+        if (t == Token_End && last)
+            break;
+        if (in_map) {
+            if (t != Token_String)
+                error("Unexpected item whilst seeking map element key");
+            handler->on_key(string_item);
+            if (get_token() != Token_Colon)
+                error("Unexpected item whilst seeking map element colon");
+            get_value(get_token(), "map element value");
+        } else
+            get_value(t, "list element");
+        t = get_token();
+        if (t == Token_End)
+            break;
+        if (t != Token_Comma)
+            error("Unexpected item whilst seeking comma");
+    }
+    if (in_map)
+        handler->on_map_end();
+    else
+        handler->on_list_end();
+}
+
+//static
+MValue Reader::read_parallel(
+    std::string_view s, unsigned n_threads)
+{
+#ifdef MINION_INTRUSIVE_REFCOUNT
+    // The threads would share the macro values, whose reference counts
+    // are not thread-safe
+    n_threads = 1;
+#endif
+    if (n_threads == 0)
+        n_threads = std::thread::hardware_concurrency();
+    if (n_threads < 2 || s.size() < parallel_min_size)
+        return read(s);
+
+    TreeBuilder builder;
+    Reader reader;
+    reader.init(s, builder);
+    std::vector<segment> segments;
+    bool in_map;
+    try {
+        auto t = reader.get_macros();
+        if (t != Token_StartList && t != Token_StartMap)
+            return read(s);
+        in_map = (t == Token_StartMap);
+        size_t target = std::max(s.size() / (n_threads * thread_segments), min_segment_size);
+        if (!reader.prescan(segments, target) || segments.size() < 2
+            || reader.get_token() != Token_End)
+            return read(s);
+    } catch (MinionError&) {
+        return read(s);
+    }
+
+    // Read the segments, each thread taking the next unread one
+    std::vector<MValue> parts(segments.size());
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto work = [&]() {
+        size_t i;
+        while (!failed && (i = next++) < segments.size()) {
+            segment& seg = segments[i];
+            TreeBuilder tb;
+            tb.macro_map = builder.macro_map;
+            Reader r;
+            r.init(s.substr(0, seg.end), tb);
+            r.macro_map = reader.macro_map;
+            r.ch_index = seg.start;
+            r.line_index = seg.line_index;
+            r.ch_linestart = seg.line_start;
+            try {
+                r.get_elements(in_map, i == segments.size() - 1);
+            } catch (MinionError&) {
+                failed = true;
+                break;
+            }
+            parts[i] = std::move(tb.result);
+        }
+    };
+    std::vector<std::thread> threads;
+    size_t n = std::min(size_t(n_threads), segments.size());
+    for (size_t i = 1; i < n; ++i)
+        threads.emplace_back(work);
+    work();
+    for (auto& th : threads)
+        th.join();
+    if (failed)
+        return read(s);
+
+    // Join the parts
+    if (in_map) {
+        MMap& m = **parts[0].m_map();
+        for (size_t i = 1; i < parts.size(); ++i)
+            m.append(**parts[i].m_map());
+    } else {
+        MList& l = **parts[0].m_list();
+        for (size_t i = 1; i < parts.size(); ++i) {
+            MList& p = **parts[i].m_list();
+            l.insert(l.end(), std::make_move_iterator(p.begin()), std::make_move_iterator(p.end()));
+        }
+    }
+    return parts[0];
+}
+
+} // namespace minion
@@ -0,0 +1,368 @@
+#include "minion.h"
+
+namespace minion {
+
+/* The input is collected in `buffer` until it contains a complete token,
+ * which is then read by the normal tokenizer (`Reader::get_token`). So
+ * that the tokenizer never sees the end of the buffer in the middle of a
+ * token, a light-weight scan (`token_ready`) first looks for the end of
+ * the next token. This scan is resumable, so that each byte is examined
+ * only once, however the input is divided into chunks.
+ * The tokens are passed to a state machine which does the work of
+ * `Reader::get_list`, `Reader::get_map`, etc., but with an explicit stack
+ * in place of the recursion, calling the handler in the same way.
+ */
+
+// States of the token scan
+enum {
+    X_Space,          // seeking the start of a token
+    X_Hash,           // after '#'
+    X_LineComment,    // within a "normal" comment
+    X_BlockComment,   // within "#[ ... ]#"
+    X_BlockCommentEnd, // after ']' in "#[ ... ]#"
+    X_String,         // within a delimited string
+    X_StringEscape,   // after '\' in a delimited string
+    X_StringComment,  // within "\[ ... \]" in a delimited string
+    X_StringCommentEscape, // after '\' in a string comment
+    X_Bare            // within an undelimited string or macro name
+};
+
+// Parser states
+enum {
+    P_Top,        // seeking a macro definition or the top-level item
+    P_MacroColon, // after a macro name
+    P_MacroValue, // after a macro name and colon
+    P_MacroComma, // after a macro definition
+    P_End,        // the top-level item is complete
+    P_ListValue,  // seeking a list element
+    P_ListComma,  // after a list element
+    P_MapKey,     // seeking a map key
+    P_MapColon,   // after a map key
+    P_MapValue,   // after a map key and colon
+    P_MapComma    // after a map value
+};
+
+// Bytes of processed input kept as context for error messages
+const size_t history = 80;
+// Minimum number of processed bytes to remove from the buffer in one go
+const size_t compact_size = 4096;
+
+StreamReader::StreamReader()
+    : StreamReader(builder)
+{}
+
+StreamReader::StreamReader(
+    Handler& h)
+    : finished{false}
+    , done{false}
+    , scan_state{X_Space}
+    , scan_pos{0}
+    , state{P_Top}
+{
+    reader.init(buffer, h);
+}
+
+bool StreamReader::feed(
+    std::string_view chunk)
+{
+    if (finished || (done && result.error_message()))
+        return true;
+    buffer.append(chunk);
+    parse();
+    return done;
+}
+
+MValue StreamReader::finish()
+{
+    if (!finished) {
+        finished = true;
+        if (!(done && result.error_message()))
+            parse();
+    }
+    return result;
+}
+
+// Return true if the buffer holds the whole of the next token, or if
+// the tokenizer must otherwise be called (the end of the input, or a
+// character which will cause an error).
+bool StreamReader::token_ready()
+{
+    size_t n = buffer.size();
+    for (; scan_pos < n; ++scan_pos) {
+        unsigned char ch = buffer[scan_pos];
+        if ((ch < 32 && ch != '\n' && ch != '\t' && ch != '\r') || ch == 127)
+            return true; // illegal character, the tokenizer reports it
+        switch (scan_state) {
+        case X_Space:
+            switch (ch) {
+            case ' ':
+            case '\n':
+            case '\t':
+            case '\r':
+                break;
+            case '#':
+                scan_state = X_Hash;
+                break;
+            case '"':
+                scan_state = X_String;
+                break;
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                return true;
+            default:
+                scan_state = X_Bare;
+            }
+            break;
+        case X_Hash:
+            if (ch == '[')
+                scan_state = X_BlockComment;
+            else if (ch == '\n')
+                scan_state = X_Space;
+            else
+                scan_state = X_LineComment;
+            break;
+        case X_LineComment:
+            if (ch == '\n')
+                scan_state = X_Space;
+            break;
+        case X_BlockComment:
+            if (ch == ']')
+                scan_state = X_BlockCommentEnd;
+            break;
+        case X_BlockCommentEnd:
+            if (ch == '#')
+                scan_state = X_Space;
+            else if (ch != ']')
+                scan_state = X_BlockComment;
+            break;
+        case X_String:
+            if (ch == '"' || ch < 32)
+                return true;
+            if (ch == '\\')
+                scan_state = X_StringEscape;
+            break;
+        case X_StringEscape:
+            scan_state = (ch == '[') ? X_StringComment : X_String;
+            break;
+        case X_StringComment:
+            if (ch == '\\')
+                scan_state = X_StringCommentEscape;
+            break;
+        case X_StringCommentEscape:
+            if (ch == ']')
+                scan_state = X_String;
+            else if (ch != '\\')
+                scan_state = X_StringComment;
+            break;
+        case X_Bare:
+            switch (ch) {
+            case ' ':
+            case '\n':
+            case '\t':
+            case '\r':
+            case ':':
+            case ',':
+            case ']':
+            case '}':
+            case '{':
+            case '[':
+            case '\\':
+            case '"':
+                return true;
+            }
+        }
+    }
+    return finished;
+}
+
+// Process all complete tokens in the buffer.
+void StreamReader::parse()
+{
+    reader.input = buffer;
+    reader.scanner.reset(reader.input);
+    try {
+        while (token_ready()) {
+            int t = reader.get_token();
+            scan_pos = reader.ch_index;
+            scan_state = X_Space;
+            take_token(t);
+            if (t == Token_End)
+                break;
+        }
+    } catch (MinionError& e) {
+        result = e;
+        done = true;
+        return;
+    }
+    compact();
+}
+
+// Remove processed input from the buffer, keeping a little for error
+// reports. Positions within the buffer must be adjusted accordingly.
+// `ch_linestart` may refer to a line start which has been removed, but
+// column numbers remain correct with unsigned arithmetic.
+void StreamReader::compact()
+{
+    if (reader.ch_index < history + compact_size)
+        return;
+    size_t n = reader.ch_index - history;
+    if (n < buffer.size() / 2)
+        return; // not worth moving the rest of the buffer
+    buffer.erase(0, n);
+    reader.ch_index -= n;
+    reader.ch_linestart -= n;
+    scan_pos -= n;
+    reader.input = buffer;
+    reader.scanner.reset(reader.input);
+}
+
+void StreamReader::unexpected(
+    std::string_view msg, int t)
+{
+    reader.error(std::string{msg}
+                     .append(reader.token_text(t))
+                     .append(" ... current position ")
+                     .append(reader.pos(reader.here())));
+}
+
+// Handle the start of a value: a string or macro is complete, a list or
+// map is opened. Return false if the token cannot start a value.
+bool StreamReader::start_value(
+    int t)
+{
+    switch (t) {
+    case Token_String:
+        reader.handler->on_string(reader.string_item);
+        value_done();
+        return true;
+    case Token_Macro:
+        reader.check_macro(reader.string_item);
+        reader.handler->on_macro_ref(reader.string_item);
+        value_done();
+        return true;
+    case Token_StartList:
+        reader.handler->on_list_begin();
+        stack.push_back(state);
+        state = P_ListValue;
+        return true;
+    case Token_StartMap:
+        reader.handler->on_map_begin();
+        stack.push_back(state);
+        state = P_MapKey;
+        return true;
+    }
+    return false;
+}
+
+// Move on from a complete value (in the state in which it was started).
+void StreamReader::value_done()
+{
+    switch (state) {
+    case P_Top:
+        if (reader.handler == &builder)
+            result = builder.result;
+        state = P_End;
+        done = true;
+        break;
+    case P_MacroValue:
+        reader.macro_map.emplace_back(std::move(macro_key), MValue{});
+        state = P_MacroComma;
+        break;
+    case P_ListValue:
+        state = P_ListComma;
+        break;
+    case P_MapValue:
+        state = P_MapComma;
+        break;
+    }
+}
+
+void StreamReader::end_container()
+{
+    if (state == P_ListValue || state == P_ListComma)
+        reader.handler->on_list_end();
+    else
+        reader.handler->on_map_end();
+    state = stack.back();
+    stack.pop_back();
+    value_done();
+}
+
+void StreamReader::take_token(
+    int t)
+{
+    switch (state) {
+    case P_Top:
+        if (t == Token_Macro) {
+            macro_key = reader.string_item;
+            state = P_MacroColon;
+        } else if (!start_value(t))
+            unexpected("Unexpected item whilst seeking top-level element: ", t);
+        break;
+    case P_MacroColon:
+        if (t != Token_Colon)
+            unexpected("Unexpected item whilst seeking macro definition colon: ", t);
+        reader.handler->on_macro_def(macro_key);
+        state = P_MacroValue;
+        break;
+    case P_MacroValue:
+        if (!start_value(t))
+            unexpected("Unexpected item whilst seeking macro definition value: ", t);
+        break;
+    case P_MacroComma:
+        if (t != Token_Comma)
+            unexpected("Expecting comma after macro definition, unexpected item: ", t);
+        state = P_Top;
+        break;
+    case P_End:
+        if (t != Token_End)
+            unexpected("Expecting end of data, unexpected item: ", t);
+        break;
+    case P_ListValue:
+        if (t == Token_EndList)
+            end_container();
+        else if (!start_value(t))
+            unexpected("Unexpected item whilst seeking list element: ", t);
+        break;
+    case P_ListComma:
+        if (t == Token_Comma)
+            state = P_ListValue;
+        else if (t == Token_EndList)
+            end_container();
+        else
+            unexpected("Unexpected item whilst seeking comma in list: ", t);
+        break;
+    case P_MapKey:
+        if (t == Token_String) {
+            reader.handler->on_key(reader.string_item);
+            state = P_MapColon;
+        } else if (t == Token_EndMap)
+            end_container();
+        else
+            unexpected("Unexpected item whilst seeking map element key: ", t);
+        break;
+    case P_MapColon:
+        if (t != Token_Colon)
+            unexpected("Unexpected item whilst seeking map element colon: ", t);
+        state = P_MapValue;
+        break;
+    case P_MapValue:
+        if (!start_value(t))
+            unexpected("Unexpected item whilst seeking map element value: ", t);
+        break;
+    case P_MapComma:
+        if (t == Token_Comma)
+            state = P_MapKey;
+        else if (t == Token_EndMap)
+            end_container();
+        else
+            unexpected("Unexpected item whilst seeking comma in map: ", t);
+        break;
+    }
+}
+
+} // namespace minion
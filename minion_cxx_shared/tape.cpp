@@ -0,0 +1,275 @@
+#include "tape.h"
+#include <unordered_map>
+
+namespace minion {
+
+// The handler which writes the tape
+class TapeBuilder : public Handler
+{
+    Tape& tape;
+    std::vector<size_t> stack; // open lists and maps
+    std::unordered_map<std::string, size_t> macros;
+    std::string macro_name;
+    bool in_macro{false};
+
+    // Add an entry, which starts an item, return its index
+    size_t add(
+        uint32_t type, uint32_t size, uint64_t value)
+    {
+        size_t i = tape.entries.size();
+        if (!stack.empty()) {
+            // The elements of a map are counted by `on_key`
+            auto& c = tape.entries[stack.back()];
+            if (c.type == T_List)
+                ++c.size;
+        } else if (in_macro) {
+            macros.emplace(std::move(macro_name), i);
+            in_macro = false;
+        } else
+            tape.root_index = i;
+        tape.entries.push_back({type, size, value});
+        return i;
+    }
+
+    void end()
+    {
+        tape.entries[stack.back()].value = tape.entries.size();
+        stack.pop_back();
+    }
+
+public:
+    TapeBuilder(
+        Tape& t)
+        : tape{t}
+    {}
+
+    void on_string(
+        std::string_view s) override
+    {
+        add(T_String, s.size(), tape.strings.size());
+        tape.strings.append(s);
+    }
+    void on_list_begin() override { stack.push_back(add(T_List, 0, 0)); }
+    void on_list_end() override { end(); }
+    void on_map_begin() override { stack.push_back(add(T_Map, 0, 0)); }
+    void on_map_end() override { end(); }
+    void on_key(
+        std::string_view key) override
+    {
+        ++tape.entries[stack.back()].size;
+        on_string(key);
+    }
+    void on_macro_def(
+        std::string_view name) override
+    {
+        macro_name = name;
+        in_macro = true;
+    }
+    void on_macro_ref(
+        std::string_view name) override
+    {
+        add(T_Ref, 0, macros.at(std::string{name}));
+    }
+};
+
+const char* Tape::read(
+    std::string_view s)
+{
+    clear();
+    TapeBuilder builder(*this);
+    return done(Reader::read(s, builder));
+}
+
+const char* Tape::read_binary(
+    std::string_view s)
+{
+    clear();
+    TapeBuilder builder(*this);
+    return done(Reader::read_binary(s, builder));
+}
+
+// Finish reading, given the result from the reader
+const char* Tape::done(
+    MValue e)
+{
+    if (e.is_null()) {
+        // Release the spare capacity, the document is not changed again
+        entries.shrink_to_fit();
+        strings.shrink_to_fit();
+        return nullptr;
+    }
+    clear();
+    error_message = e.error_message();
+    return error_message.c_str();
+}
+
+void Tape::clear()
+{
+    entries.clear();
+    strings.clear();
+    root_index = 0;
+}
+
+Node Tape::root()
+{
+    if (entries.empty())
+        return {};
+    return Node(this, root_index);
+}
+
+// A reference is replaced by the item it refers to
+Node::Node(
+    const Tape* t, size_t i)
+    : tape{t}
+    , index{i}
+{
+    while (tape->entries[index].type == T_Ref)
+        index = tape->entries[index].value;
+}
+
+int Node::type()
+{
+    if (!tape)
+        return T_NoType;
+    return tape->entries[index].type;
+}
+
+size_t Node::size()
+{
+    if (!tape || tape->entries[index].type == T_String)
+        return 0;
+    return tape->entries[index].size;
+}
+
+std::string_view Node::str()
+{
+    if (!tape)
+        return {};
+    auto& e = tape->entries[index];
+    if (e.type != T_String)
+        return {};
+    return std::string_view{tape->strings}.substr(e.value, e.size);
+}
+
+// Return the index of the entry following the item at entry `i` (a
+// reference is a single entry).
+static size_t skip(
+    const std::vector<tape_entry>& entries, size_t i)
+{
+    auto& e = entries[i];
+    if (e.type == T_List || e.type == T_Map)
+        return e.value;
+    return i + 1;
+}
+
+Node Node::get(
+    size_t n)
+{
+    if (type() != T_List || n >= size())
+        return {};
+    size_t i = index + 1;
+    for (; n != 0; --n)
+        i = skip(tape->entries, i);
+    return Node(tape, i);
+}
+
+Node Node::get(
+    std::string_view key)
+{
+    if (type() != T_Map)
+        return {};
+    size_t i = index + 1;
+    for (size_t n = size(); n != 0; --n) {
+        auto& k = tape->entries[i];
+        if (std::string_view{tape->strings}.substr(k.value, k.size) == key)
+            return Node(tape, i + 1);
+        i = skip(tape->entries, i + 1);
+    }
+    return {};
+}
+
+std::string_view Node::key(
+    size_t n)
+{
+    if (type() != T_Map || n >= size())
+        return {};
+    size_t i = index + 1;
+    for (; n != 0; --n)
+        i = skip(tape->entries, i + 1);
+    return Node(tape, i).str();
+}
+
+Node Node::value(
+    size_t n)
+{
+    if (type() != T_Map || n >= size())
+        return {};
+    size_t i = index + 1;
+    for (; n != 0; --n)
+        i = skip(tape->entries, i + 1);
+    return Node(tape, i + 1);
+}
+
+bool Node::get_string(
+    size_t n, std::string& s)
+{
+    Node m = get(n);
+    if (m.is_null())
+        return false;
+    if (m.type() == T_String) {
+        s = m.str();
+        return true;
+    }
+    std::string msg{"List: expecting string at index: "};
+    throw MinionError(msg.append(std::to_string(n)));
+}
+
+bool Node::get_string(
+    std::string_view key, std::string& s)
+{
+    Node m = get(key);
+    if (m.is_null())
+        return false;
+    if (m.type() == T_String) {
+        s = m.str();
+        return true;
+    }
+    std::string msg{"Map: value not string for key: "};
+    throw MinionError(msg.append(key));
+}
+
+Node::iterator Node::begin()
+{
+    int t = type();
+    if (t != T_List && t != T_Map)
+        return {tape, 0, false};
+    return {tape, index + 1, t == T_Map};
+}
+
+Node::iterator Node::end()
+{
+    int t = type();
+    if (t != T_List && t != T_Map)
+        return {tape, 0, false};
+    return {tape, tape->entries[index].value, t == T_Map};
+}
+
+Node Node::iterator::operator*()
+{
+    return Node(tape, in_map ? pos + 1 : pos);
+}
+
+std::string_view Node::iterator::key()
+{
+    if (!in_map)
+        return {};
+    return Node(tape, pos).str();
+}
+
+Node::iterator& Node::iterator::operator++()
+{
+    pos = skip(tape->entries, in_map ? pos + 1 : pos);
+    return *this;
+}
+
+} // namespace minion
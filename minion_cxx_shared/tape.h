@@ -0,0 +1,122 @@
+#ifndef TAPE_H
+#define TAPE_H
+
+#include "minion.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* An alternative, read-only representation of a MINION document, which
+ * is much more compact than a tree of `MValue`s. The items are held in a
+ * single vector (the "tape") of small entries, in input order, the string
+ * data in a single string. A list or map entry records the position of
+ * the entry following its last element, so that it can be skipped in one
+ * step. The elements of a map are its keys and values alternately.
+ * A macro reference is an entry referring to the macro's value, which is
+ * stored only once.
+ * The items are accessed using `Node` cursors. Access to a list element
+ * or map entry by index or key takes time proportional to its position,
+ * iteration (`Node::iterator`) is the efficient way to visit them all.
+ */
+
+namespace minion {
+
+struct tape_entry
+{
+    uint32_t type; // T_String, T_List, T_Map or T_Ref
+    uint32_t size; // string length, number of list or map elements
+    uint64_t value; // string offset, end of list or map, referenced entry
+};
+
+enum { T_Ref = 8 };
+
+class Tape;
+
+class Node
+{
+    const Tape* tape{nullptr};
+    size_t index{0};
+
+    Node(const Tape* t, size_t i);
+
+    friend Tape;
+
+public:
+    Node() = default;
+
+    bool is_null() { return tape == nullptr; }
+    int type();
+    // The number of elements of a list or map
+    size_t size();
+
+    // The value of a string node (empty for other nodes)
+    std::string_view str();
+
+    // List element, null if out of range
+    Node get(size_t index);
+    // Map value, null if the key is not present (the first entry is found
+    // if a key occurs more than once)
+    Node get(std::string_view key);
+    // Key and value of a map entry, by index
+    std::string_view key(size_t index);
+    Node value(size_t index);
+
+    // As for MList and MMap: return false if the element is not present,
+    // throw MinionError if it is not a string
+    bool get_string(size_t index, std::string& s);
+    bool get_string(std::string_view key, std::string& s);
+
+    // Iteration over the elements of a list or the entries of a map
+    class iterator
+    {
+        const Tape* tape;
+        size_t pos; // tape position of the element, or the map key
+        bool in_map;
+
+        friend Node;
+        iterator(
+            const Tape* t, size_t p, bool m)
+            : tape{t}
+            , pos{p}
+            , in_map{m}
+        {}
+
+    public:
+        Node operator*(); // list element or map value
+        std::string_view key(); // map key
+        iterator& operator++();
+        bool operator!=(const iterator& other) const { return pos != other.pos; }
+    };
+
+    iterator begin();
+    iterator end();
+};
+
+class Tape
+{
+    std::vector<tape_entry> entries;
+    std::string strings;
+    size_t root_index{0};
+    std::string error_message;
+
+    const char* done(MValue e);
+
+    friend Node;
+    friend class TapeBuilder;
+
+public:
+    // Read a document, replacing any previous contents. Return nullptr if
+    // successful, otherwise an error message.
+    const char* read(std::string_view s);
+    // The same for the binary form (binary.h)
+    const char* read_binary(std::string_view s);
+
+    Node root();
+    void clear();
+    // Memory used by the document, in bytes
+    size_t memory() { return entries.capacity() * sizeof(tape_entry) + strings.capacity(); }
+};
+
+} // namespace minion
+
+#endif // TAPE_H
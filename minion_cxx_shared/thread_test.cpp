@@ -0,0 +1,105 @@
+/* Test of values shared between threads (parse cache results and macro
+ * library values): lookups on a shared value only read it, so that
+ * several threads can use it at once. This is mainly of use in a build
+ * with ThreadSanitizer (-fsanitize=thread).
+ */
+
+#include "cache.h"
+#include "minion.h"
+#include <atomic>
+#include <barrier>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace minion;
+
+namespace {
+
+const int n_threads = 4;
+const int n_keys = 40; // enough for the map to have a key index
+
+std::atomic<int> failures{0};
+
+void check(
+    const char* what, bool ok)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// Look up all the keys of the map
+void lookups(
+    MMap& mm)
+{
+    for (int i = 0; i < n_keys; ++i) {
+        std::string k = "k" + std::to_string(i);
+        std::string_view v;
+        if (!mm.get_string(k, v) || v != "v" + std::to_string(i))
+            check("lookup", false);
+    }
+    check("missing key", mm.find("none") == nullptr);
+}
+
+// Run `get` on several threads at once, then – once all the threads
+// have their result – the lookups on the results. Each round uses a new
+// input (differing only in spacing), so that the maps are new. `get` is
+// called twice, as threads reading the same new input at the same time
+// may each get their own result from a cache.
+template<typename F>
+void run(
+    F get)
+{
+    std::barrier sync(n_threads);
+    auto work = [&]() {
+        for (int r = 0; r < 20; ++r) {
+            get(std::string(r, ' '));
+            sync.arrive_and_wait();
+            MValue m = get(std::string(r, ' '));
+            auto mm = m.m_map();
+            check("map expected", mm);
+            sync.arrive_and_wait();
+            if (mm)
+                lookups(**mm);
+            sync.arrive_and_wait();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t)
+        threads.emplace_back(work);
+    for (auto& th : threads)
+        th.join();
+}
+
+std::string big_map()
+{
+    std::string s = "{";
+    for (int i = 0; i < n_keys; ++i)
+        s += "k" + std::to_string(i) + ": v" + std::to_string(i) + ", ";
+    return s + "}";
+}
+
+} // namespace
+
+int main()
+{
+    // Results shared through the parse cache
+    run([](std::string space) { return ParseCache::global().read(space + big_map()); });
+    check("cache hits", ParseCache::global().stats().hits != 0);
+    printf("%s: cached lookups\n", failures ? "FAILED" : "ok");
+
+    // Values shared through a macro library
+    MacroLibrary lib;
+    check("library", lib.read("&T: " + big_map() + ",").is_null());
+    run([&](std::string space) {
+        MValue m = Reader::read(space + "[&T]", lib);
+        auto ml = m.m_list();
+        return ml && (*ml)->size() == 1 ? (**ml)[0] : MValue{};
+    });
+    printf("%s: library lookups\n", failures ? "FAILED" : "ok");
+
+    return failures == 0 ? 0 : 1;
+}